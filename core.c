@@ -30,6 +30,8 @@
 #include <linux/delay.h>
 #include <linux/sysfs.h>
 #include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "solo6x10.h"
 #include "tw28.h"
@@ -49,6 +51,12 @@ static int full_eeprom; /* default is only top 64B */
 module_param(full_eeprom, uint, 0644);
 MODULE_PARM_DESC(full_eeprom, "Allow access to full 128B EEPROM (dangerous)");
 
+static int compact_sdram;
+module_param(compact_sdram, uint, 0444);
+MODULE_PARM_DESC(compact_sdram, "Size the capture area for the card's own "
+		 "channels rather than 16, leaving more SDRAM to the encoder "
+		 "rings");
+
 
 static void solo_set_time(struct solo_dev *solo_dev)
 {
@@ -100,6 +108,10 @@ static void solo_timer_sync(struct solo_dev *solo_dev)
 	}
 }
 
+/* Everything but the P2M engines is serviced from solo_isr_thread() */
+#define SOLO_IRQ_THREADED	(SOLO_IRQ_IIC | SOLO_IRQ_VIDEO_IN | \
+				 SOLO_IRQ_ENCODER | SOLO_IRQ_G723)
+
 static irqreturn_t solo_isr(int irq, void *data)
 {
 	struct solo_dev *solo_dev = data;
@@ -110,19 +122,38 @@ static irqreturn_t solo_isr(int irq, void *data)
 	if (!status)
 		return IRQ_NONE;
 
-	if (status & ~solo_dev->irq_mask) {
-		solo_reg_write(solo_dev, SOLO_IRQ_STAT,
-			       status & ~solo_dev->irq_mask);
-		status &= solo_dev->irq_mask;
-	}
+	/* Ack everything up front, the thread works from irq_pending */
+	solo_reg_write(solo_dev, SOLO_IRQ_STAT, status);
+	status &= solo_dev->irq_mask;
 
 	if (status & SOLO_IRQ_PCI_ERR)
 		solo_p2m_error_isr(solo_dev);
 
+	/* Kept here so that chained transfers are restarted right away */
 	for (i = 0; i < SOLO_NR_P2M; i++)
 		if (status & SOLO_IRQ_P2M(i))
 			solo_p2m_isr(solo_dev, i);
 
+	if (!(status & SOLO_IRQ_THREADED))
+		return IRQ_HANDLED;
+
+	spin_lock(&solo_dev->irq_lock);
+	solo_dev->irq_pending |= status & SOLO_IRQ_THREADED;
+	spin_unlock(&solo_dev->irq_lock);
+
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t solo_isr_thread(int irq, void *data)
+{
+	struct solo_dev *solo_dev = data;
+	u32 status;
+
+	spin_lock_irq(&solo_dev->irq_lock);
+	status = solo_dev->irq_pending;
+	solo_dev->irq_pending = 0;
+	spin_unlock_irq(&solo_dev->irq_lock);
+
 	if (status & SOLO_IRQ_IIC)
 		solo_i2c_isr(solo_dev);
 
@@ -137,12 +168,186 @@ static irqreturn_t solo_isr(int irq, void *data)
 	if (status & SOLO_IRQ_G723)
 		solo_g723_isr(solo_dev);
 
-	/* Clear all interrupts handled */
-	solo_reg_write(solo_dev, SOLO_IRQ_STAT, status);
-
 	return IRQ_HANDLED;
 }
 
+static const struct {
+	int		reg;
+	const char	*name;
+} solo_shadow_regs[SOLO_NR_SHADOW] = {
+#define SOLO_SHADOW(__reg) \
+	[SOLO_SHADOW_##__reg] = { SOLO_##__reg, #__reg }
+	SOLO_SHADOW(VE_OSD_CH),
+	SOLO_SHADOW(GPIO_CONFIG_0),
+	SOLO_SHADOW(GPIO_CONFIG_1),
+	SOLO_SHADOW(GPIO_DATA_OUT),
+	SOLO_SHADOW(VI_MOT_ADR),
+#undef SOLO_SHADOW
+};
+
+/* Seed the shadows from the hardware. Done again once the chip has been
+ * reset during SDRAM sizing. */
+void solo_shadow_init(struct solo_dev *solo_dev)
+{
+	int i;
+
+	for (i = 0; i < SOLO_NR_SHADOW; i++)
+		solo_dev->shadow[i] = solo_reg_read(solo_dev,
+						    solo_shadow_regs[i].reg);
+}
+
+u32 solo_shadow_update(struct solo_dev *solo_dev, int idx, u32 clear,
+		       u32 set)
+{
+	unsigned long flags;
+	u32 val;
+
+	spin_lock_irqsave(&solo_dev->shadow_lock, flags);
+	val = (solo_dev->shadow[idx] & ~clear) | set;
+	solo_dev->shadow[idx] = val;
+	solo_reg_write(solo_dev, solo_shadow_regs[idx].reg, val);
+	spin_unlock_irqrestore(&solo_dev->shadow_lock, flags);
+
+	return val;
+}
+
+void solo_shadow_write(struct solo_dev *solo_dev, int idx, u32 val)
+{
+	solo_shadow_update(solo_dev, idx, ~0, val);
+}
+
+static int solo_shadow_show(struct seq_file *m, void *v)
+{
+	struct solo_dev *solo_dev = m->private;
+	int i;
+
+	seq_puts(m, "# name reg shadow hardware\n");
+
+	for (i = 0; i < SOLO_NR_SHADOW; i++) {
+		u32 shadow = solo_shadow_read(solo_dev, i);
+		u32 hw = solo_reg_read(solo_dev, solo_shadow_regs[i].reg);
+
+		seq_printf(m, "%-14s 0x%04x 0x%08x 0x%08x%s\n",
+			   solo_shadow_regs[i].name, solo_shadow_regs[i].reg,
+			   shadow, hw, shadow != hw ? " MISMATCH" : "");
+	}
+
+	return 0;
+}
+
+static int solo_shadow_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, solo_shadow_show, inode->i_private);
+}
+
+static const struct file_operations solo_shadow_fops = {
+	.owner		= THIS_MODULE,
+	.open		= solo_shadow_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const char * const solo_sdram_names[SOLO_SDRAM_NR_REGIONS] = {
+	[SOLO_SDRAM_DISP]	= "DISP",
+	[SOLO_SDRAM_EOSD]	= "EOSD",
+	[SOLO_SDRAM_MOTION]	= "MOTI",
+	[SOLO_SDRAM_G723]	= "G723",
+	[SOLO_SDRAM_CAP]	= "CAPT",
+	[SOLO_SDRAM_EREF]	= "EREF",
+	[SOLO_SDRAM_MP4E]	= "MPEG",
+	[SOLO_SDRAM_JPEG]	= "JPEG",
+};
+
+static void solo_layout_add(struct solo_layout *l, int id, u32 size,
+			    u32 unit)
+{
+	l->region[id].addr = l->end;
+	l->region[id].size = size;
+	l->region[id].unit = unit;
+	l->end += size;
+}
+
+/* Lay out the card's SDRAM once it has been sized. Everything else reads
+ * region addresses and sizes back from solo_dev->layout. */
+static int solo_layout_init(struct solo_dev *solo_dev)
+{
+	struct solo_layout *l = &solo_dev->layout;
+	int sdram_size = solo_dev->sdram_size;
+	int jpeg_min = solo_dev->nr_chans * 0x00080000;
+	int mp4e_size, jpeg_size;
+	int cap_frames;
+	int i;
+
+	memset(l, 0, sizeof(*l));
+
+	solo_layout_add(l, SOLO_SDRAM_DISP, SOLO_DISP_EXT_SIZE, 0);
+	solo_layout_add(l, SOLO_SDRAM_EOSD, SOLO_EOSD_EXT_SIZE(solo_dev) * 32,
+			SOLO_EOSD_EXT_SIZE(solo_dev));
+	solo_layout_add(l, SOLO_SDRAM_MOTION, SOLO_MOTION_EXT_SIZE, 0);
+	solo_layout_add(l, SOLO_SDRAM_G723, SOLO_G723_EXT_SIZE, 0);
+
+	/* Always allow the encoder enough for 16 channels, even if we have
+	 * less. The exception is if we have card with only 32Megs of
+	 * memory, or were asked to only cover our own channels. */
+	if (sdram_size <= (32 << 20))
+		cap_frames = 4;
+	else if (compact_sdram)
+		cap_frames = solo_dev->nr_chans;
+	else
+		cap_frames = 16;
+	solo_layout_add(l, SOLO_SDRAM_CAP,
+			(cap_frames + 1) * SOLO_CAP_PAGE_SIZE,
+			SOLO_CAP_PAGE_SIZE);
+
+	/* A reference frame per channel for each of the standard and the
+	 * extended encoders, see solo_mp4e_config() */
+	solo_layout_add(l, SOLO_SDRAM_EREF,
+			SOLO_EREF_EXT_SIZE * solo_dev->nr_chans * 2,
+			SOLO_EREF_EXT_SIZE);
+
+	/* The encoder rings get what is left, MPEG first, up to 16M each
+	 * since queue entries only carry 24 bits of offset */
+	mp4e_size = max(jpeg_min,
+			min(sdram_size - (int)l->end - jpeg_min, 0x00ff0000));
+	solo_layout_add(l, SOLO_SDRAM_MP4E, mp4e_size, 0);
+
+	jpeg_size = max(jpeg_min, min(sdram_size - (int)l->end, 0x00ff0000));
+	solo_layout_add(l, SOLO_SDRAM_JPEG, jpeg_size, 0);
+
+	for (i = 0; i < SOLO_SDRAM_NR_REGIONS; i++) {
+		struct solo_sdram_region *r = &l->region[i];
+
+		dev_dbg(&solo_dev->pdev->dev, "%s: 0x%08x @ 0x%08x\n",
+			solo_sdram_names[i], r->addr, r->size);
+
+		/* The hardware takes region bases in 64K units */
+		if (!r->size || (r->addr | r->size) & 0xffff) {
+			dev_err(&solo_dev->pdev->dev,
+				"Bad SDRAM region %s (0x%08x @ 0x%08x)\n",
+				solo_sdram_names[i], r->addr, r->size);
+			return -EIO;
+		}
+
+		if (i && r->addr < l->region[i - 1].addr +
+				   l->region[i - 1].size) {
+			dev_err(&solo_dev->pdev->dev,
+				"SDRAM region %s overlaps %s\n",
+				solo_sdram_names[i], solo_sdram_names[i - 1]);
+			return -EIO;
+		}
+	}
+
+	if (l->end > (u32)sdram_size) {
+		dev_err(&solo_dev->pdev->dev,
+			"SDRAM is not large enough (%u < %u)\n",
+			sdram_size, l->end);
+		return -EIO;
+	}
+
+	return 0;
+}
+
 static void free_solo_dev(struct solo_dev *solo_dev)
 {
 	struct pci_dev *pdev;
@@ -162,12 +367,16 @@ static void free_solo_dev(struct solo_dev *solo_dev)
 		return;
 	}
 
+	debugfs_remove_recursive(solo_dev->debugfs);
+
 	if (solo_dev->reg_base) {
 		/* Bring down the sub-devices first */
 		solo_g723_exit(solo_dev);
 		solo_enc_v4l2_exit(solo_dev);
 		solo_enc_exit(solo_dev);
 		solo_v4l2_exit(solo_dev);
+		if (solo_dev->v4l2_dev.dev)
+			v4l2_device_unregister(&solo_dev->v4l2_dev);
 		solo_disp_exit(solo_dev);
 		solo_gpio_exit(solo_dev);
 		solo_p2m_exit(solo_dev);
@@ -260,6 +469,16 @@ static ssize_t p2m_timeouts_show(struct device *dev,
 	return sprintf(buf, "%d\n", solo_dev->p2m_timeouts);
 }
 
+static ssize_t p2m_engines_show(struct device *dev,
+				struct device_attribute *attr,
+				char *buf)
+{
+	struct solo_dev *solo_dev =
+		container_of(dev, struct solo_dev, dev);
+
+	return solo_p2m_show_engines(solo_dev, buf);
+}
+
 static ssize_t sdram_size_show(struct device *dev,
 			       struct device_attribute *attr,
 			       char *buf)
@@ -355,14 +574,28 @@ static ssize_t intervals_show(struct device *dev,
 	int i;
 
 	for (i = 0; i < solo_dev->nr_chans; i++) {
-		out += sprintf(out, "Channel %d: %d/%d (0x%08x)\n",
-			       i, solo_dev->v4l2_enc[i]->interval, fps,
-			       solo_reg_read(solo_dev, SOLO_CAP_CH_INTV(i)));
+		struct solo_enc_dev *solo_enc = solo_dev->v4l2_enc[i];
+
+		out += sprintf(out, "Channel %d: %d/%d (0x%08x), "
+			       "set to %d/%d, priority %d\n",
+			       i, solo_enc->sched_interval, fps,
+			       solo_reg_read(solo_dev, SOLO_CAP_CH_INTV(i)),
+			       solo_enc->interval, fps, solo_enc->priority);
 	}
 
 	return out - buf;
 }
 
+static ssize_t enc_drops_show(struct device *dev,
+			      struct device_attribute *attr,
+			      char *buf)
+{
+	struct solo_dev *solo_dev =
+		container_of(dev, struct solo_dev, dev);
+
+	return solo_enc_drops_show(solo_dev, buf);
+}
+
 static ssize_t sdram_offsets_show(struct device *dev,
 				  struct device_attribute *attr,
 				  char *buf)
@@ -370,45 +603,23 @@ static ssize_t sdram_offsets_show(struct device *dev,
 	struct solo_dev *solo_dev =
 		container_of(dev, struct solo_dev, dev);
 	char *out = buf;
+	int i;
+
+	for (i = 0; i < SOLO_SDRAM_NR_REGIONS; i++) {
+		struct solo_sdram_region *r = &solo_dev->layout.region[i];
 
-	out += sprintf(out, "DISP: 0x%08x @ 0x%08x\n",
-		       SOLO_DISP_EXT_ADDR,
-		       SOLO_DISP_EXT_SIZE);
-
-	out += sprintf(out, "EOSD: 0x%08x @ 0x%08x (0x%08x * %d)\n",
-		       SOLO_EOSD_EXT_ADDR,
-		       SOLO_EOSD_EXT_AREA(solo_dev),
-		       SOLO_EOSD_EXT_SIZE(solo_dev),
-		       SOLO_EOSD_EXT_AREA(solo_dev) /
-		       SOLO_EOSD_EXT_SIZE(solo_dev));
-
-	out += sprintf(out, "MOTI: 0x%08x @ 0x%08x\n",
-		       SOLO_MOTION_EXT_ADDR(solo_dev),
-		       SOLO_MOTION_EXT_SIZE);
-
-	out += sprintf(out, "G723: 0x%08x @ 0x%08x\n",
-		       SOLO_G723_EXT_ADDR(solo_dev),
-		       SOLO_G723_EXT_SIZE);
-
-	out += sprintf(out, "CAPT: 0x%08x @ 0x%08x (0x%08x * %d)\n",
-		       SOLO_CAP_EXT_ADDR(solo_dev),
-		       SOLO_CAP_EXT_SIZE(solo_dev),
-		       SOLO_CAP_PAGE_SIZE,
-		       SOLO_CAP_EXT_SIZE(solo_dev) / SOLO_CAP_PAGE_SIZE);
-
-	out += sprintf(out, "EREF: 0x%08x @ 0x%08x (0x%08x * %d)\n",
-		       SOLO_EREF_EXT_ADDR(solo_dev),
-		       SOLO_EREF_EXT_AREA(solo_dev),
-		       SOLO_EREF_EXT_SIZE,
-		       SOLO_EREF_EXT_AREA(solo_dev) / SOLO_EREF_EXT_SIZE);
-
-	out += sprintf(out, "MPEG: 0x%08x @ 0x%08x\n",
-		       SOLO_MP4E_EXT_ADDR(solo_dev),
-		       SOLO_MP4E_EXT_SIZE(solo_dev));
-
-	out += sprintf(out, "JPEG: 0x%08x @ 0x%08x\n",
-		       SOLO_JPEG_EXT_ADDR(solo_dev),
-		       SOLO_JPEG_EXT_SIZE(solo_dev));
+		out += sprintf(out, "%s: 0x%08x @ 0x%08x", solo_sdram_names[i],
+			       r->addr, r->size);
+		if (r->unit)
+			out += sprintf(out, " (0x%08x * %d)", r->unit,
+				       r->size / r->unit);
+		out += sprintf(out, "\n");
+	}
+
+	if (solo_dev->layout.end < (u32)solo_dev->sdram_size)
+		out += sprintf(out, "FREE: 0x%08x @ 0x%08x\n",
+			       solo_dev->layout.end,
+			       solo_dev->sdram_size - solo_dev->layout.end);
 
 	return out - buf;
 }
@@ -433,7 +644,8 @@ static ssize_t sdram_show(struct kobject *kobj, struct bin_attribute *a,
 	if (off + count > size)
 		count = size - off;
 
-	if (solo_p2m_dma(solo_dev, 0, buf, off, count, 0, 0))
+	if (solo_p2m_dma(solo_dev, SOLO_P2M_CALLER_SDRAM, 0, buf, off, count,
+			 0, 0))
 		return -EIO;
 
 	return count;
@@ -444,11 +656,13 @@ static const struct device_attribute solo_dev_attrs[] = {
 	__ATTR(video_type, 0644, video_type_show, video_type_store),
 	__ATTR(p2m_timeout, 0644, p2m_timeout_show, p2m_timeout_store),
 	__ATTR_RO(p2m_timeouts),
+	__ATTR_RO(p2m_engines),
 	__ATTR_RO(sdram_size),
 	__ATTR_RO(tw28xx),
 	__ATTR_RO(input_map),
 	__ATTR_RO(intervals),
 	__ATTR_RO(sdram_offsets),
+	__ATTR_RO(enc_drops),
 };
 
 static void solo_device_release(struct device *dev)
@@ -499,10 +713,30 @@ static int solo_sysfs_init(struct solo_dev *solo_dev)
 	return 0;
 }
 
+/* Debug only, so failing to set this up is not fatal */
+static void solo_debugfs_init(struct solo_dev *solo_dev)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), SOLO6X10_NAME "-%s",
+		 pci_name(solo_dev->pdev));
+
+	solo_dev->debugfs = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(solo_dev->debugfs)) {
+		solo_dev->debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("shadow_regs", S_IRUGO, solo_dev->debugfs,
+			    solo_dev, &solo_shadow_fops);
+	solo_p2m_debugfs_init(solo_dev);
+}
+
 static int solo_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 {
 	struct solo_dev *solo_dev;
 	int ret;
+	int i;
 	u8 chip_id;
 
 	solo_dev = kzalloc(sizeof(*solo_dev), GFP_KERNEL);
@@ -517,6 +751,11 @@ static int solo_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	solo_dev->type = id->driver_data;
 	solo_dev->pdev = pdev;
 	spin_lock_init(&solo_dev->reg_io_lock);
+	spin_lock_init(&solo_dev->shadow_lock);
+	spin_lock_init(&solo_dev->irq_lock);
+	spin_lock_init(&solo_dev->p2m_pool_lock);
+	for (i = 0; i < SOLO_P2M_POOL_CLASSES; i++)
+		INIT_LIST_HEAD(&solo_dev->p2m_pool[i]);
 	pci_set_drvdata(pdev, solo_dev);
 
 	/* Only for during init */
@@ -542,6 +781,8 @@ static int solo_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		goto fail_probe;
 	}
 
+	solo_shadow_init(solo_dev);
+
 	chip_id = solo_reg_read(solo_dev, SOLO_CHIP_OPTION) &
 				SOLO_CHIP_ID_MASK;
 	switch (chip_id) {
@@ -602,8 +843,8 @@ static int solo_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	/* PLL locking time of 1ms */
 	mdelay(1);
 
-	ret = request_irq(pdev->irq, solo_isr, IRQF_SHARED, SOLO6X10_NAME,
-			  solo_dev);
+	ret = request_threaded_irq(pdev->irq, solo_isr, solo_isr_thread,
+				   IRQF_SHARED, SOLO6X10_NAME, solo_dev);
 	if (ret)
 		goto fail_probe;
 
@@ -640,6 +881,13 @@ static int solo_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	if (ret)
 		goto fail_probe;
 
+	/* SDRAM sizing in solo_p2m_init() resets the chip */
+	solo_shadow_init(solo_dev);
+
+	ret = solo_layout_init(solo_dev);
+	if (ret)
+		goto fail_probe;
+
 	ret = solo_disp_init(solo_dev);
 	if (ret)
 		goto fail_probe;
@@ -652,6 +900,10 @@ static int solo_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	if (ret)
 		goto fail_probe;
 
+	ret = v4l2_device_register(&pdev->dev, &solo_dev->v4l2_dev);
+	if (ret)
+		goto fail_probe;
+
 	ret = solo_v4l2_init(solo_dev, video_nr);
 	if (ret)
 		goto fail_probe;
@@ -672,6 +924,8 @@ static int solo_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	if (ret)
 		goto fail_probe;
 
+	solo_debugfs_init(solo_dev);
+
 	/* Now that init is over, set this lower */
 	solo_dev->p2m_jiffies = msecs_to_jiffies(20);
 
@@ -689,7 +943,7 @@ static void solo_pci_remove(struct pci_dev *pdev)
 	free_solo_dev(solo_dev);
 }
 
-static DEFINE_PCI_DEVICE_TABLE(solo_id_table) = {
+static const struct pci_device_id solo_id_table[] = {
 	/* 6010 based cards */
 	{ PCI_DEVICE(PCI_VENDOR_ID_SOFTLOGIC, PCI_DEVICE_ID_SOLO6010),
 	  .driver_data = SOLO_DEV_6010 },
@@ -188,7 +188,7 @@ static int solo_dma_vin_region(struct solo_dev *solo_dev, u32 off,
 		buf[i] = val;
 
 	for (i = 0; i < reg_size; i += sizeof(buf))
-		ret |= solo_p2m_dma(solo_dev, 1, buf,
+		ret |= solo_p2m_dma(solo_dev, SOLO_P2M_CALLER_MOTION, 1, buf,
 				    SOLO_MOTION_EXT_ADDR(solo_dev) + off + i,
 				    sizeof(buf), 0, 0);
 
@@ -219,13 +219,15 @@ int solo_set_motion_block(struct solo_dev *solo_dev, u8 ch, u16 val,
 
 	/* Read and write only on a 128-byte boundary; 4-byte writes with
 	   solo_p2m_dma silently failed. Bluecherry bug #908. */
-	re = solo_p2m_dma(solo_dev, 0, &buf, addr & ~0x7f, sizeof(buf), 0, 0);
+	re = solo_p2m_dma(solo_dev, SOLO_P2M_CALLER_MOTION, 0, &buf,
+			  addr & ~0x7f, sizeof(buf), 0, 0);
 	if (re)
 		return re;
 
 	buf[(addr & 0x7f) / 2] = val;
 
-	re = solo_p2m_dma(solo_dev, 1, &buf, addr & ~0x7f, sizeof(buf), 0, 0);
+	re = solo_p2m_dma(solo_dev, SOLO_P2M_CALLER_MOTION, 1, &buf,
+			  addr & ~0x7f, sizeof(buf), 0, 0);
 	if (re)
 		return re;
 
@@ -256,8 +258,9 @@ static void solo_motion_config(struct solo_dev *solo_dev)
 	}
 
 	/* Default motion settings */
-	solo_reg_write(solo_dev, SOLO_VI_MOT_ADR, SOLO_VI_MOTION_EN(0) |
-		       (SOLO_MOTION_EXT_ADDR(solo_dev) >> 16));
+	solo_shadow_write(solo_dev, SOLO_SHADOW_VI_MOT_ADR,
+			  SOLO_VI_MOTION_EN(0) |
+			  (SOLO_MOTION_EXT_ADDR(solo_dev) >> 16));
 	solo_reg_write(solo_dev, SOLO_VI_MOT_CTRL,
 		       SOLO_VI_MOTION_FRAME_COUNT(3) |
 		       SOLO_VI_MOTION_SAMPLE_LENGTH(solo_dev->video_hsize / 16)
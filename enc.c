@@ -37,87 +37,98 @@ static void solo_capture_config(struct solo_dev *solo_dev)
 {
 	unsigned long height;
 	unsigned long width;
+	unsigned long flags;
 	void *buf;
 	int i;
 
-	solo_reg_write(solo_dev, SOLO_CAP_BASE,
-		       SOLO_CAP_MAX_PAGE((SOLO_CAP_EXT_SIZE(solo_dev)
-					  - SOLO_CAP_PAGE_SIZE) >> 16)
-		       | SOLO_CAP_BASE_ADDR(SOLO_CAP_EXT_ADDR(solo_dev) >> 16));
+	/* Clear OSD; this one is shadowed, so it can't go in the batch */
+	solo_shadow_write(solo_dev, SOLO_SHADOW_VE_OSD_CH, 0);
+
+	solo_reg_batch_begin(solo_dev, &flags);
+
+	solo_reg_batch_write(solo_dev, SOLO_CAP_BASE,
+		SOLO_CAP_MAX_PAGE((SOLO_CAP_EXT_SIZE(solo_dev)
+				   - SOLO_CAP_PAGE_SIZE) >> 16)
+		| SOLO_CAP_BASE_ADDR(SOLO_CAP_EXT_ADDR(solo_dev) >> 16));
 
 	/* XXX: Undocumented bits at b17 and b24 */
 	if (solo_dev->type == SOLO_DEV_6110) {
 		/* NOTE: Ref driver has (62 << 24) here as well, but it causes
 		 * wacked out frame timing on 4-port 6110. */
-		solo_reg_write(solo_dev, SOLO_CAP_BTW,
-			       (1 << 17) | SOLO_CAP_PROG_BANDWIDTH(2) |
-			       SOLO_CAP_MAX_BANDWIDTH(36));
+		solo_reg_batch_write(solo_dev, SOLO_CAP_BTW,
+				     (1 << 17) | SOLO_CAP_PROG_BANDWIDTH(2) |
+				     SOLO_CAP_MAX_BANDWIDTH(36));
 	} else {
-		solo_reg_write(solo_dev, SOLO_CAP_BTW,
-			       (1 << 17) | SOLO_CAP_PROG_BANDWIDTH(2) |
-			       SOLO_CAP_MAX_BANDWIDTH(32));
+		solo_reg_batch_write(solo_dev, SOLO_CAP_BTW,
+				     (1 << 17) | SOLO_CAP_PROG_BANDWIDTH(2) |
+				     SOLO_CAP_MAX_BANDWIDTH(32));
 	}
 
 	/* Set scale 1, 9 dimension */
 	width = solo_dev->video_hsize;
 	height = solo_dev->video_vsize;
-	solo_reg_write(solo_dev, SOLO_DIM_SCALE1,
-		       SOLO_DIM_H_MB_NUM(width / 16) |
-		       SOLO_DIM_V_MB_NUM_FRAME(height / 8) |
-		       SOLO_DIM_V_MB_NUM_FIELD(height / 16));
+	solo_reg_batch_write(solo_dev, SOLO_DIM_SCALE1,
+			     SOLO_DIM_H_MB_NUM(width / 16) |
+			     SOLO_DIM_V_MB_NUM_FRAME(height / 8) |
+			     SOLO_DIM_V_MB_NUM_FIELD(height / 16));
 
 	/* Set scale 2, 10 dimension */
 	width = solo_dev->video_hsize / 2;
 	height = solo_dev->video_vsize;
-	solo_reg_write(solo_dev, SOLO_DIM_SCALE2,
-		       SOLO_DIM_H_MB_NUM(width / 16) |
-		       SOLO_DIM_V_MB_NUM_FRAME(height / 8) |
-		       SOLO_DIM_V_MB_NUM_FIELD(height / 16));
+	solo_reg_batch_write(solo_dev, SOLO_DIM_SCALE2,
+			     SOLO_DIM_H_MB_NUM(width / 16) |
+			     SOLO_DIM_V_MB_NUM_FRAME(height / 8) |
+			     SOLO_DIM_V_MB_NUM_FIELD(height / 16));
 
 	/* Set scale 3, 11 dimension */
 	width = solo_dev->video_hsize / 2;
 	height = solo_dev->video_vsize / 2;
-	solo_reg_write(solo_dev, SOLO_DIM_SCALE3,
-		       SOLO_DIM_H_MB_NUM(width / 16) |
-		       SOLO_DIM_V_MB_NUM_FRAME(height / 8) |
-		       SOLO_DIM_V_MB_NUM_FIELD(height / 16));
+	solo_reg_batch_write(solo_dev, SOLO_DIM_SCALE3,
+			     SOLO_DIM_H_MB_NUM(width / 16) |
+			     SOLO_DIM_V_MB_NUM_FRAME(height / 8) |
+			     SOLO_DIM_V_MB_NUM_FIELD(height / 16));
 
 	/* Set scale 4, 12 dimension */
 	width = solo_dev->video_hsize / 3;
 	height = solo_dev->video_vsize / 3;
-	solo_reg_write(solo_dev, SOLO_DIM_SCALE4,
-		       SOLO_DIM_H_MB_NUM(width / 16) |
-		       SOLO_DIM_V_MB_NUM_FRAME(height / 8) |
-		       SOLO_DIM_V_MB_NUM_FIELD(height / 16));
+	solo_reg_batch_write(solo_dev, SOLO_DIM_SCALE4,
+			     SOLO_DIM_H_MB_NUM(width / 16) |
+			     SOLO_DIM_V_MB_NUM_FRAME(height / 8) |
+			     SOLO_DIM_V_MB_NUM_FIELD(height / 16));
 
 	/* Set scale 5, 13 dimension */
 	width = solo_dev->video_hsize / 4;
 	height = solo_dev->video_vsize / 2;
-	solo_reg_write(solo_dev, SOLO_DIM_SCALE5,
-		       SOLO_DIM_H_MB_NUM(width / 16) |
-		       SOLO_DIM_V_MB_NUM_FRAME(height / 8) |
-		       SOLO_DIM_V_MB_NUM_FIELD(height / 16));
+	solo_reg_batch_write(solo_dev, SOLO_DIM_SCALE5,
+			     SOLO_DIM_H_MB_NUM(width / 16) |
+			     SOLO_DIM_V_MB_NUM_FRAME(height / 8) |
+			     SOLO_DIM_V_MB_NUM_FIELD(height / 16));
 
 	/* Progressive */
 	width = VI_PROG_HSIZE;
 	height = VI_PROG_VSIZE;
-	solo_reg_write(solo_dev, SOLO_DIM_PROG,
-		       SOLO_DIM_H_MB_NUM(width / 16) |
-		       SOLO_DIM_V_MB_NUM_FRAME(height / 16) |
-		       SOLO_DIM_V_MB_NUM_FIELD(height / 16));
+	solo_reg_batch_write(solo_dev, SOLO_DIM_PROG,
+			     SOLO_DIM_H_MB_NUM(width / 16) |
+			     SOLO_DIM_V_MB_NUM_FRAME(height / 16) |
+			     SOLO_DIM_V_MB_NUM_FIELD(height / 16));
 
-	/* Clear OSD */
-	solo_reg_write(solo_dev, SOLO_VE_OSD_CH, 0);
-	solo_reg_write(solo_dev, SOLO_VE_OSD_BASE, SOLO_EOSD_EXT_ADDR >> 16);
-	solo_reg_write(solo_dev, SOLO_VE_OSD_CLR,
-		       0xF0 << 16 | 0x80 << 8 | 0x80);
+	/* OSD */
+	solo_reg_batch_write(solo_dev, SOLO_VE_OSD_BASE,
+			     SOLO_EOSD_EXT_ADDR >> 16);
+	solo_reg_batch_write(solo_dev, SOLO_VE_OSD_CLR,
+			     0xF0 << 16 | 0x80 << 8 | 0x80);
 
 	if (solo_dev->type == SOLO_DEV_6010)
-		solo_reg_write(solo_dev, SOLO_VE_OSD_OPT,
-			       SOLO_VE_OSD_H_SHADOW | SOLO_VE_OSD_V_SHADOW);
+		solo_reg_batch_write(solo_dev, SOLO_VE_OSD_OPT,
+				     SOLO_VE_OSD_H_SHADOW |
+				     SOLO_VE_OSD_V_SHADOW);
 	else
-		solo_reg_write(solo_dev, SOLO_VE_OSD_OPT, SOLO_VE_OSD_V_DOUBLE
-			       | SOLO_VE_OSD_H_SHADOW | SOLO_VE_OSD_V_SHADOW);
+		solo_reg_batch_write(solo_dev, SOLO_VE_OSD_OPT,
+				     SOLO_VE_OSD_V_DOUBLE |
+				     SOLO_VE_OSD_H_SHADOW |
+				     SOLO_VE_OSD_V_SHADOW);
+
+	solo_reg_batch_commit(solo_dev, flags);
 
 	/* Clear OSG buffer */
 	buf = kzalloc(SOLO_EOSD_EXT_SIZE(solo_dev), GFP_KERNEL);
@@ -125,7 +136,7 @@ static void solo_capture_config(struct solo_dev *solo_dev)
 		return;
 
 	for (i = 0; i < solo_dev->nr_chans; i++) {
-		solo_p2m_dma(solo_dev, 1, buf,
+		solo_p2m_dma(solo_dev, SOLO_P2M_CALLER_OSD, 1, buf,
 			     SOLO_EOSD_EXT_ADDR +
 			     (SOLO_EOSD_EXT_SIZE(solo_dev) * i),
 			     SOLO_EOSD_EXT_SIZE(solo_dev), 0, 0);
@@ -139,7 +150,6 @@ int solo_osd_print(struct solo_enc_dev *solo_enc)
 	struct solo_dev *solo_dev = solo_enc->solo_dev;
 	unsigned char *str = solo_enc->osd_text;
 	u8 *buf = solo_enc->osd_buf;
-	u32 reg = solo_reg_read(solo_dev, SOLO_VE_OSD_CH);
 	const struct font_desc *vga = find_font("VGA8x16");
 	const unsigned char *vga_data;
 	int len;
@@ -152,8 +162,8 @@ int solo_osd_print(struct solo_enc_dev *solo_enc)
 
 	if (len == 0) {
 		/* Disable OSD on this channel */
-		reg &= ~(1 << solo_enc->ch);
-		solo_reg_write(solo_dev, SOLO_VE_OSD_CH, reg);
+		solo_shadow_update(solo_dev, SOLO_SHADOW_VE_OSD_CH,
+				   1 << solo_enc->ch, 0);
 		return 0;
 	}
 
@@ -169,14 +179,14 @@ int solo_osd_print(struct solo_enc_dev *solo_enc)
 		}
 	}
 
-	solo_p2m_dma(solo_dev, 1, buf,
+	solo_p2m_dma(solo_dev, SOLO_P2M_CALLER_OSD, 1, buf,
 		     SOLO_EOSD_EXT_ADDR +
 		     (solo_enc->ch * SOLO_EOSD_EXT_SIZE(solo_dev)),
 		     SOLO_EOSD_EXT_SIZE(solo_dev), 0, 0);
 
 	/* Enable OSD on this channel */
-	reg |= (1 << solo_enc->ch);
-	solo_reg_write(solo_dev, SOLO_VE_OSD_CH, reg);
+	solo_shadow_update(solo_dev, SOLO_SHADOW_VE_OSD_CH, 0,
+			   1 << solo_enc->ch);
 
 	return 0;
 }
@@ -268,13 +278,16 @@ static void solo_jpeg_config(struct solo_dev *solo_dev)
 
 static void solo_mp4e_config(struct solo_dev *solo_dev)
 {
+	unsigned long flags;
 	int i;
 	u32 cfg;
 
-	solo_reg_write(solo_dev, SOLO_VE_CFG0,
-		       SOLO_VE_INTR_CTRL(IRQ_LEVEL) |
-		       SOLO_VE_BLOCK_SIZE(SOLO_MP4E_EXT_SIZE(solo_dev) >> 16) |
-		       SOLO_VE_BLOCK_BASE(SOLO_MP4E_EXT_ADDR(solo_dev) >> 16));
+	solo_reg_batch_begin(solo_dev, &flags);
+
+	solo_reg_batch_write(solo_dev, SOLO_VE_CFG0,
+		SOLO_VE_INTR_CTRL(IRQ_LEVEL) |
+		SOLO_VE_BLOCK_SIZE(SOLO_MP4E_EXT_SIZE(solo_dev) >> 16) |
+		SOLO_VE_BLOCK_BASE(SOLO_MP4E_EXT_ADDR(solo_dev) >> 16));
 
 
 	cfg = SOLO_VE_BYTE_ALIGN(2) | SOLO_VE_INSERT_INDEX
@@ -285,38 +298,42 @@ static void solo_mp4e_config(struct solo_dev *solo_dev)
 		cfg |= SOLO_VE_JPEG_SIZE_H(
 			(SOLO_JPEG_EXT_SIZE(solo_dev) >> 24) & 0x0f);
 	}
-	solo_reg_write(solo_dev, SOLO_VE_CFG1, cfg);
+	solo_reg_batch_write(solo_dev, SOLO_VE_CFG1, cfg);
 
-	solo_reg_write(solo_dev, SOLO_VE_WMRK_POLY, 0);
-	solo_reg_write(solo_dev, SOLO_VE_VMRK_INIT_KEY, 0);
-	solo_reg_write(solo_dev, SOLO_VE_WMRK_STRL, 0);
+	solo_reg_batch_write(solo_dev, SOLO_VE_WMRK_POLY, 0);
+	solo_reg_batch_write(solo_dev, SOLO_VE_VMRK_INIT_KEY, 0);
+	solo_reg_batch_write(solo_dev, SOLO_VE_WMRK_STRL, 0);
 	if (solo_dev->type == SOLO_DEV_6110)
-		solo_reg_write(solo_dev, SOLO_VE_WMRK_ENABLE, 0);
-	solo_reg_write(solo_dev, SOLO_VE_ENCRYP_POLY, 0);
-	solo_reg_write(solo_dev, SOLO_VE_ENCRYP_INIT, 0);
+		solo_reg_batch_write(solo_dev, SOLO_VE_WMRK_ENABLE, 0);
+	solo_reg_batch_write(solo_dev, SOLO_VE_ENCRYP_POLY, 0);
+	solo_reg_batch_write(solo_dev, SOLO_VE_ENCRYP_INIT, 0);
 
-	solo_reg_write(solo_dev, SOLO_VE_ATTR,
-		       SOLO_VE_LITTLE_ENDIAN |
-		       SOLO_COMP_ATTR_FCODE(1) |
-		       SOLO_COMP_TIME_INC(0) |
-		       SOLO_COMP_TIME_WIDTH(15) |
-		       SOLO_DCT_INTERVAL(solo_dev->type == SOLO_DEV_6010 ? 9 : 10));
+	solo_reg_batch_write(solo_dev, SOLO_VE_ATTR,
+		SOLO_VE_LITTLE_ENDIAN |
+		SOLO_COMP_ATTR_FCODE(1) |
+		SOLO_COMP_TIME_INC(0) |
+		SOLO_COMP_TIME_WIDTH(15) |
+		SOLO_DCT_INTERVAL(solo_dev->type == SOLO_DEV_6010 ? 9 : 10));
 
 	for (i = 0; i < solo_dev->nr_chans; i++) {
-		solo_reg_write(solo_dev, SOLO_VE_CH_REF_BASE(i),
-			       (SOLO_EREF_EXT_ADDR(solo_dev) +
-			       (i * SOLO_EREF_EXT_SIZE)) >> 16);
-		solo_reg_write(solo_dev, SOLO_VE_CH_REF_BASE_E(i),
-			       (SOLO_EREF_EXT_ADDR(solo_dev) +
-			       ((i + 16) * SOLO_EREF_EXT_SIZE)) >> 16);
+		solo_reg_batch_write(solo_dev, SOLO_VE_CH_REF_BASE(i),
+				     (SOLO_EREF_EXT_ADDR(solo_dev) +
+				     (i * SOLO_EREF_EXT_SIZE)) >> 16);
+		solo_reg_batch_write(solo_dev, SOLO_VE_CH_REF_BASE_E(i),
+				     (SOLO_EREF_EXT_ADDR(solo_dev) +
+				     ((i + solo_dev->nr_chans) *
+				      SOLO_EREF_EXT_SIZE)) >> 16);
 	}
 
 	if (solo_dev->type == SOLO_DEV_6110) {
-		solo_reg_write(solo_dev, SOLO_VE_COMPT_MOT, 0x00040008);
+		solo_reg_batch_write(solo_dev, SOLO_VE_COMPT_MOT, 0x00040008);
 	} else {
 		for (i = 0; i < solo_dev->nr_chans; i++)
-			solo_reg_write(solo_dev, SOLO_VE_CH_MOT(i), 0x100);
+			solo_reg_batch_write(solo_dev, SOLO_VE_CH_MOT(i),
+					     0x100);
 	}
+
+	solo_reg_batch_commit(solo_dev, flags);
 }
 
 int solo_enc_init(struct solo_dev *solo_dev)
@@ -239,7 +239,8 @@ static int snd_solo_pcm_copy(struct snd_pcm_substream *ss, int channel,
 	for (i = 0; i < (count / G723_FRAMES_PER_PAGE); i++) {
 		int page = (pos / G723_FRAMES_PER_PAGE) + i;
 
-		err = solo_p2m_dma_t(solo_dev, 0, solo_pcm->g723_dma,
+		err = solo_p2m_dma_t(solo_dev, SOLO_P2M_CALLER_AUDIO, 0,
+				     solo_pcm->g723_dma,
 				     SOLO_G723_EXT_ADDR(solo_dev) +
 				     (page * G723_PERIOD_BLOCK) +
 				     (ss->number * G723_PERIOD_BYTES),
@@ -365,8 +366,13 @@ int solo_g723_init(struct solo_dev *solo_dev)
 	/* Allows for easier mapping between video and audio */
 	sprintf(name, "Softlogic%d", solo_dev->vfd->num);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+	ret = snd_card_new(&solo_dev->pdev->dev, SNDRV_DEFAULT_IDX1, name,
+			   THIS_MODULE, 0, &solo_dev->snd_card);
+#else
 	ret = snd_card_create(SNDRV_DEFAULT_IDX1, name, THIS_MODULE, 0,
 			      &solo_dev->snd_card);
+#endif
 	if (ret < 0)
 		return ret;
 
@@ -376,7 +382,9 @@ int solo_g723_init(struct solo_dev *solo_dev)
 	strcpy(card->shortname, "SOLO-6x10 Audio");
 	sprintf(card->longname, "%s on %s IRQ %d", card->shortname,
 		pci_name(solo_dev->pdev), solo_dev->pdev->irq);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0)
 	snd_card_set_dev(card, &solo_dev->pdev->dev);
+#endif
 
 	ret = snd_device_new(card, SNDRV_DEV_LOWLEVEL, solo_dev, &ops);
 	if (ret < 0)
@@ -35,7 +35,7 @@ static void solo_gpio_mode(struct solo_dev *solo_dev,
 	int port;
 	unsigned int ret;
 
-	ret = solo_reg_read(solo_dev, SOLO_GPIO_CONFIG_0);
+	ret = solo_shadow_read(solo_dev, SOLO_SHADOW_GPIO_CONFIG_0);
 
 	/* To set gpio */
 	for (port = 0; port < 16; port++) {
@@ -46,10 +46,10 @@ static void solo_gpio_mode(struct solo_dev *solo_dev,
 		ret |= ((mode & 3) << (port << 1));
 	}
 
-	solo_reg_write(solo_dev, SOLO_GPIO_CONFIG_0, ret);
+	solo_shadow_write(solo_dev, SOLO_SHADOW_GPIO_CONFIG_0, ret);
 
 	/* To set extended gpio - sensor */
-	ret = solo_reg_read(solo_dev, SOLO_GPIO_CONFIG_1);
+	ret = solo_shadow_read(solo_dev, SOLO_SHADOW_GPIO_CONFIG_1);
 
 	for (port = 0; port < 16; port++) {
 		if (!((1 << (port + 16)) & port_mask))
@@ -61,19 +61,17 @@ static void solo_gpio_mode(struct solo_dev *solo_dev,
 			ret |= 1 << port;
 	}
 
-	solo_reg_write(solo_dev, SOLO_GPIO_CONFIG_1, ret);
+	solo_shadow_write(solo_dev, SOLO_SHADOW_GPIO_CONFIG_1, ret);
 }
 
 static void solo_gpio_set(struct solo_dev *solo_dev, unsigned int value)
 {
-	solo_reg_write(solo_dev, SOLO_GPIO_DATA_OUT,
-		       solo_reg_read(solo_dev, SOLO_GPIO_DATA_OUT) | value);
+	solo_shadow_update(solo_dev, SOLO_SHADOW_GPIO_DATA_OUT, 0, value);
 }
 
 static void solo_gpio_clear(struct solo_dev *solo_dev, unsigned int value)
 {
-	solo_reg_write(solo_dev, SOLO_GPIO_DATA_OUT,
-		       solo_reg_read(solo_dev, SOLO_GPIO_DATA_OUT) & ~value);
+	solo_shadow_update(solo_dev, SOLO_SHADOW_GPIO_DATA_OUT, value, 0);
 }
 
 static void solo_gpio_config(struct solo_dev *solo_dev)
@@ -24,8 +24,15 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/delay.h>
 
 #include "solo6x10.h"
+#include "compat.h"
 
 static int multi_p2m;
 module_param(multi_p2m, uint, 0644);
@@ -33,14 +40,118 @@ MODULE_PARM_DESC(multi_p2m,
 		 "Use multiple P2M DMA channels (default: no, 6010-only)");
 
 static int desc_mode;
-module_param(desc_mode, uint, 0644);
+module_param(desc_mode, uint, 0444);
 MODULE_PARM_DESC(desc_mode,
 		 "Allow use of descriptor mode DMA (default: no, 6010-only)");
 
-int solo_p2m_dma(struct solo_dev *solo_dev, int wr,
+/* Size classes for the bounce pool. Most control-plane transfers (motion
+ * tables, sdram reads) are small; the largest class covers a whole OSD
+ * bitmap and the SDRAM sizing test. */
+static const struct {
+	unsigned int size;
+	unsigned int count;
+} solo_p2m_pool_cfg[SOLO_P2M_POOL_CLASSES] = {
+	{ 256,				8 },
+	{ PAGE_SIZE,			4 },
+	{ SOLO_EOSD_EXT_SIZE_MAX,	2 },
+};
+
+static struct solo_p2m_bounce *solo_p2m_bounce_get(struct solo_dev *solo_dev,
+						   u32 size)
+{
+	struct solo_p2m_bounce *bounce = NULL;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&solo_dev->p2m_pool_lock, flags);
+
+	for (i = 0; i < SOLO_P2M_POOL_CLASSES; i++) {
+		struct list_head *head = &solo_dev->p2m_pool[i];
+
+		if (size > solo_p2m_pool_cfg[i].size || list_empty(head))
+			continue;
+
+		bounce = list_first_entry(head, struct solo_p2m_bounce, list);
+		list_del(&bounce->list);
+		break;
+	}
+
+	if (!bounce)
+		solo_dev->p2m_pool_misses++;
+
+	spin_unlock_irqrestore(&solo_dev->p2m_pool_lock, flags);
+
+	return bounce;
+}
+
+static void solo_p2m_bounce_put(struct solo_dev *solo_dev,
+				struct solo_p2m_bounce *bounce)
+{
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < SOLO_P2M_POOL_CLASSES; i++) {
+		if (bounce->size == solo_p2m_pool_cfg[i].size)
+			break;
+	}
+
+	spin_lock_irqsave(&solo_dev->p2m_pool_lock, flags);
+	list_add(&bounce->list, &solo_dev->p2m_pool[i]);
+	spin_unlock_irqrestore(&solo_dev->p2m_pool_lock, flags);
+}
+
+static void solo_p2m_pool_free(struct solo_dev *solo_dev)
+{
+	struct solo_p2m_bounce *bounce, *tmp;
+	int i;
+
+	for (i = 0; i < SOLO_P2M_POOL_CLASSES; i++) {
+		list_for_each_entry_safe(bounce, tmp, &solo_dev->p2m_pool[i],
+					 list) {
+			list_del(&bounce->list);
+			pci_free_consistent(solo_dev->pdev, bounce->size,
+					    bounce->buf, bounce->dma);
+			kfree(bounce);
+		}
+	}
+}
+
+static int solo_p2m_pool_init(struct solo_dev *solo_dev)
+{
+	struct solo_p2m_bounce *bounce;
+	int i, j;
+
+	for (i = 0; i < SOLO_P2M_POOL_CLASSES; i++) {
+		for (j = 0; j < solo_p2m_pool_cfg[i].count; j++) {
+			bounce = kzalloc(sizeof(*bounce), GFP_KERNEL);
+			if (bounce == NULL)
+				goto pool_fail;
+
+			bounce->size = solo_p2m_pool_cfg[i].size;
+			bounce->buf = pci_alloc_consistent(solo_dev->pdev,
+							   bounce->size,
+							   &bounce->dma);
+			if (bounce->buf == NULL) {
+				kfree(bounce);
+				goto pool_fail;
+			}
+
+			list_add(&bounce->list, &solo_dev->p2m_pool[i]);
+		}
+	}
+
+	return 0;
+
+pool_fail:
+	solo_p2m_pool_free(solo_dev);
+	return -ENOMEM;
+}
+
+int solo_p2m_dma(struct solo_dev *solo_dev, int caller, int wr,
 		 void *sys_addr, u32 ext_addr, u32 size,
 		 int repeat, u32 ext_size)
 {
+	struct solo_p2m_bounce *bounce = NULL;
 	dma_addr_t dma_addr;
 	int ret;
 
@@ -49,10 +160,30 @@ int solo_p2m_dma(struct solo_dev *solo_dev, int wr,
 	if (WARN_ON_ONCE(!size))
 		return -EINVAL;
 
+	/* Small transfers go through the pool, which saves us mapping and
+	 * unmapping the caller's buffer each time. */
+	if (!repeat)
+		bounce = solo_p2m_bounce_get(solo_dev, size);
+
+	if (bounce) {
+		if (wr)
+			memcpy(bounce->buf, sys_addr, size);
+
+		ret = solo_p2m_dma_t(solo_dev, caller, wr, bounce->dma,
+				     ext_addr, size, 0, 0);
+
+		if (!ret && !wr)
+			memcpy(sys_addr, bounce->buf, size);
+
+		solo_p2m_bounce_put(solo_dev, bounce);
+
+		return ret;
+	}
+
 	dma_addr = pci_map_single(solo_dev->pdev, sys_addr, size,
 				  wr ? PCI_DMA_TODEVICE : PCI_DMA_FROMDEVICE);
 
-	ret = solo_p2m_dma_t(solo_dev, wr, dma_addr, ext_addr, size,
+	ret = solo_p2m_dma_t(solo_dev, caller, wr, dma_addr, ext_addr, size,
 			     repeat, ext_size);
 
 	pci_unmap_single(solo_dev->pdev, dma_addr, size,
@@ -61,77 +192,325 @@ int solo_p2m_dma(struct solo_dev *solo_dev, int wr,
 	return ret;
 }
 
-/* Mutex must be held for p2m_id before calling this!! */
-int solo_p2m_dma_desc(struct solo_dev *solo_dev,
-		      struct solo_p2m_desc *desc, dma_addr_t desc_dma,
-		      int desc_cnt)
+static inline unsigned int solo_p2m_ring_next(unsigned int idx)
 {
-	struct solo_p2m_dev *p2m_dev;
-	unsigned int timeout;
-	unsigned int config = 0;
-	int ret = 0;
-	int p2m_id = 0;
+	return (idx + 1) % SOLO_NR_P2M_DESC;
+}
+
+/* Stops the engine and programs the next transfer in register mode */
+static void solo_p2m_write_desc(struct solo_dev *solo_dev, int id,
+				struct solo_p2m_desc *desc)
+{
+	unsigned long flags;
+
+	solo_reg_batch_begin(solo_dev, &flags);
+	solo_reg_batch_write(solo_dev, SOLO_P2M_CONTROL(id), 0);
+	solo_reg_batch_write(solo_dev, SOLO_P2M_TAR_ADR(id), desc->dma_addr);
+	solo_reg_batch_write(solo_dev, SOLO_P2M_EXT_ADR(id), desc->ext_addr);
+	solo_reg_batch_write(solo_dev, SOLO_P2M_EXT_CFG(id), desc->cfg);
+	solo_reg_batch_write(solo_dev, SOLO_P2M_CONTROL(id), desc->ctrl);
+	solo_reg_batch_commit(solo_dev, flags);
+}
+
+static unsigned int solo_p2m_desc_bytes(struct solo_p2m_desc *desc)
+{
+	unsigned int bytes = (desc->cfg & 0xfffff) << 2;
+	unsigned int repeat = (desc->ctrl >> 10) & 0x3ff;
+
+	return repeat ? bytes * repeat : bytes;
+}
+
+static inline int solo_p2m_hist_bucket(u64 val)
+{
+	return min(fls64(val), SOLO_P2M_HIST_BUCKETS - 1);
+}
+
+static void solo_p2m_account_stats(struct solo_p2m_dev *p2m_dev,
+				   struct solo_p2m_req *req, ktime_t now)
+{
+	struct solo_p2m_stats *st = &p2m_dev->stats[req->caller];
+	s64 lat = ktime_us_delta(now, req->submitted);
+
+	st->reqs++;
+	st->bytes += req->bytes;
+	if (req->error == -EAGAIN)
+		st->timeouts++;
+	else if (req->error)
+		st->errors++;
+
+	st->lat_us[solo_p2m_hist_bucket(max_t(s64, lat, 0))]++;
+	st->size[solo_p2m_hist_bucket(req->bytes >> 6)]++;
+	st->descs[solo_p2m_hist_bucket(req->desc_cnt)]++;
+}
+
+/* Must be called with p2m_dev->lock held, on requests that have just left
+ * the engine. */
+static void solo_p2m_account_done(struct solo_p2m_dev *p2m_dev,
+				  struct list_head *done)
+{
+	struct solo_p2m_req *req;
+	ktime_t now = ktime_get();
+
+	list_for_each_entry(req, done, list) {
+		p2m_dev->outstanding--;
+		p2m_dev->queued_bytes -= req->bytes;
+		solo_p2m_account_stats(p2m_dev, req, now);
+	}
 
-	/* Get next ID. According to Softlogic, 6110 has problems on !=0 P2M */
-	if (solo_dev->type != SOLO_DEV_6110 && multi_p2m) {
-		p2m_id = atomic_inc_return(&solo_dev->p2m_count) % SOLO_NR_P2M;
-		if (p2m_id < 0)
-			p2m_id = -p2m_id;
+	if (p2m_dev->busy && list_empty(&p2m_dev->active)) {
+		p2m_dev->busy = 0;
+		p2m_dev->busy_ns += ktime_to_ns(ktime_sub(now,
+						  p2m_dev->busy_start));
 	}
+}
+
+/* Put the engine's ring back at ID 0. In descriptor mode, writing the
+ * base address also resets the engine's current ID. */
+static void solo_p2m_ring_reset(struct solo_dev *solo_dev,
+				struct solo_p2m_dev *p2m_dev)
+{
+	int id = p2m_dev->id;
+
+	p2m_dev->head = p2m_dev->tail = 0;
+
+	if (!p2m_dev->desc_mode)
+		return;
+
+	solo_reg_write(solo_dev, SOLO_P2M_DES_ADR(id), p2m_dev->ring_dma);
+	solo_reg_write(solo_dev, SOLO_P2M_DESC_ID(id), 0);
+}
+
+/* Must be called with p2m_dev->lock held and the engine idle. Chains as
+ * many pending requests as will fit into the ring and kicks the engine
+ * once for all of them. Like the one-shot chains this replaces, every
+ * batch is laid out from the ring base with the engine pointed at it
+ * afresh; nothing is known about the engine carrying on from where the
+ * last one stopped, or about it wrapping. */
+static void solo_p2m_start_next(struct solo_dev *solo_dev,
+				struct solo_p2m_dev *p2m_dev)
+{
+	struct solo_p2m_req *req, *tmp;
+	int id = p2m_dev->id;
+	int count = 0;
+	int reqs = 0;
+	int i;
+
+	p2m_dev->head = p2m_dev->tail = 0;
+
+	list_for_each_entry_safe(req, tmp, &p2m_dev->pending, list) {
+		if (count + req->desc_cnt > SOLO_NR_P2M_DESC - 1)
+			break;
 
-	p2m_dev = &solo_dev->p2m_dev[p2m_id];
+		for (i = 1; i <= req->desc_cnt; i++) {
+			p2m_dev->tail = solo_p2m_ring_next(p2m_dev->tail);
+			p2m_dev->ring[p2m_dev->tail] = req->desc[i];
+		}
 
-	if (mutex_lock_interruptible(&p2m_dev->mutex))
-		return -EINTR;
+		req->ring_end = p2m_dev->tail;
+		count += req->desc_cnt;
+		reqs++;
+		list_move_tail(&req->list, &p2m_dev->active);
+	}
 
-	INIT_COMPLETION(p2m_dev->completion);
-	p2m_dev->error = 0;
+	if (!count)
+		return;
 
-	if (desc_cnt > 1 && solo_dev->type != SOLO_DEV_6110 && desc_mode) {
-		/* For 6010 with more than one desc, we can do a one-shot */
-		p2m_dev->desc_count = p2m_dev->desc_idx = 0;
-		config = solo_reg_read(solo_dev, SOLO_P2M_CONFIG(p2m_id));
+	if (!p2m_dev->busy) {
+		p2m_dev->busy = 1;
+		p2m_dev->busy_start = ktime_get();
+	}
 
-		solo_reg_write(solo_dev, SOLO_P2M_DES_ADR(p2m_id), desc_dma);
-		solo_reg_write(solo_dev, SOLO_P2M_DESC_ID(p2m_id), desc_cnt);
-		solo_reg_write(solo_dev, SOLO_P2M_CONFIG(p2m_id), config |
-			       SOLO_P2M_DESC_MODE);
+	if (p2m_dev->desc_mode) {
+		/* Make sure the descriptors land before the engine is
+		 * started on them, the same way a one-shot chain was */
+		wmb();
+		solo_reg_write(solo_dev, SOLO_P2M_DES_ADR(id),
+			       p2m_dev->ring_dma);
+		solo_reg_write(solo_dev, SOLO_P2M_DESC_ID(id), p2m_dev->tail);
+		solo_reg_write(solo_dev, SOLO_P2M_CONFIG(id),
+			       p2m_dev->config | SOLO_P2M_DESC_MODE);
 	} else {
-		/* For single descriptors and 6110, we need to run each desc */
-		p2m_dev->desc_count = desc_cnt;
-		p2m_dev->desc_idx = 1;
-		p2m_dev->descs = desc;
-
-		solo_reg_write(solo_dev, SOLO_P2M_TAR_ADR(p2m_id),
-			       desc[1].dma_addr);
-		solo_reg_write(solo_dev, SOLO_P2M_EXT_ADR(p2m_id),
-			       desc[1].ext_addr);
-		solo_reg_write(solo_dev, SOLO_P2M_EXT_CFG(p2m_id),
-			       desc[1].cfg);
-		solo_reg_write(solo_dev, SOLO_P2M_CONTROL(p2m_id),
-			       desc[1].ctrl);
-	}
-
-	timeout = wait_for_completion_timeout(&p2m_dev->completion,
-					      solo_dev->p2m_jiffies);
-
-	if (WARN_ON_ONCE(p2m_dev->error))
-		ret = -EIO;
-	else if (timeout == 0) {
+		/* For 6110 (or !desc_mode), we need to run each desc */
+		p2m_dev->head = solo_p2m_ring_next(p2m_dev->head);
+		solo_p2m_write_desc(solo_dev, id,
+				    &p2m_dev->ring[p2m_dev->head]);
+		/* The ISR gives each descriptor a deadline of its own */
+		reqs = 1;
+	}
+
+	/* We only hear back once the whole chain is done, so it gets as
+	 * long as its requests would have had one after the other */
+	p2m_dev->deadline = jiffies + solo_dev->p2m_jiffies * reqs;
+	mod_timer(&p2m_dev->timer, p2m_dev->deadline);
+}
+
+/* Must be called with p2m_dev->lock held. Moves every in-flight request
+ * onto the done list and resets the engine. The complete() callbacks
+ * must be run once the lock is dropped. */
+static void solo_p2m_abort(struct solo_dev *solo_dev,
+			   struct solo_p2m_dev *p2m_dev, int error,
+			   struct list_head *done)
+{
+	struct solo_p2m_req *req;
+	LIST_HEAD(aborted);
+
+	del_timer(&p2m_dev->timer);
+
+	solo_reg_write(solo_dev, SOLO_P2M_CONTROL(p2m_dev->id), 0);
+
+	list_for_each_entry(req, &p2m_dev->active, list)
+		req->error = error;
+	list_splice_init(&p2m_dev->active, &aborted);
+	solo_p2m_account_done(p2m_dev, &aborted);
+	list_splice_tail(&aborted, done);
+
+	solo_p2m_ring_reset(solo_dev, p2m_dev);
+	solo_p2m_start_next(solo_dev, p2m_dev);
+}
+
+static void solo_p2m_complete_list(struct solo_dev *solo_dev,
+				   struct list_head *done)
+{
+	struct solo_p2m_req *req, *tmp;
+
+	list_for_each_entry_safe(req, tmp, done, list) {
+		list_del(&req->list);
+		req->complete(solo_dev, req);
+	}
+}
+
+static void solo_p2m_timeout(struct timer_list *t)
+{
+	struct solo_p2m_dev *p2m_dev = from_timer(p2m_dev, t, timer);
+	struct solo_dev *solo_dev = p2m_dev->solo_dev;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&p2m_dev->lock, flags);
+	/* The ISR may have beaten us to it and started another batch */
+	if (!list_empty(&p2m_dev->active) &&
+	    time_after_eq(jiffies, p2m_dev->deadline)) {
 		solo_dev->p2m_timeouts++;
-		ret = -EAGAIN;
+		solo_p2m_abort(solo_dev, p2m_dev, -EAGAIN, &done);
 	}
+	spin_unlock_irqrestore(&p2m_dev->lock, flags);
+
+	solo_p2m_complete_list(solo_dev, &done);
+}
+
+/* Pick the engine with the fewest bytes queued, breaking ties on the
+ * number of outstanding requests. The scan starts at a rotating offset so
+ * that idle engines share the work. This is only a hint, so the counters
+ * are read without taking each engine's lock. */
+static int solo_p2m_pick_engine(struct solo_dev *solo_dev)
+{
+	struct solo_p2m_dev *p2m_dev;
+	unsigned long best_bytes = ULONG_MAX;
+	unsigned int best_reqs = UINT_MAX;
+	int start, best = 0;
+	int i;
 
-	solo_reg_write(solo_dev, SOLO_P2M_CONTROL(p2m_id), 0);
+	/* According to Softlogic, 6110 has problems on !=0 P2M */
+	if (solo_dev->type == SOLO_DEV_6110 || !multi_p2m)
+		return 0;
 
-	/* Don't write here for the no_desc_mode case, because config is 0.
-	 * We can't test no_desc_mode again, it might race. */
-	if (desc_cnt > 1 && solo_dev->type != SOLO_DEV_6110 && config)
-		solo_reg_write(solo_dev, SOLO_P2M_CONFIG(p2m_id), config);
+	start = (unsigned int)atomic_inc_return(&solo_dev->p2m_count) %
+		SOLO_NR_P2M;
 
-	mutex_unlock(&p2m_dev->mutex);
+	for (i = 0; i < SOLO_NR_P2M; i++) {
+		int id = (start + i) % SOLO_NR_P2M;
+		unsigned long bytes;
+		unsigned int reqs;
+
+		p2m_dev = &solo_dev->p2m_dev[id];
+		bytes = READ_ONCE(p2m_dev->queued_bytes);
+		reqs = READ_ONCE(p2m_dev->outstanding);
+
+		if (bytes < best_bytes ||
+		    (bytes == best_bytes && reqs < best_reqs)) {
+			best = id;
+			best_bytes = bytes;
+			best_reqs = reqs;
+		}
 
-	return ret;
+		if (!reqs)
+			break;
+	}
+
+	return best;
+}
+
+static void __solo_p2m_submit(struct solo_dev *solo_dev,
+			      struct solo_p2m_dev *p2m_dev,
+			      struct solo_p2m_req *req)
+{
+	unsigned long flags;
+	int i;
+
+	req->error = 0;
+	req->submitted = ktime_get();
+	req->bytes = 0;
+	for (i = 1; i <= req->desc_cnt; i++)
+		req->bytes += solo_p2m_desc_bytes(&req->desc[i]);
+
+	spin_lock_irqsave(&p2m_dev->lock, flags);
+	p2m_dev->outstanding++;
+	p2m_dev->queued_bytes += req->bytes;
+	p2m_dev->total_reqs++;
+	p2m_dev->total_bytes += req->bytes;
+	list_add_tail(&req->list, &p2m_dev->pending);
+	if (list_empty(&p2m_dev->active))
+		solo_p2m_start_next(solo_dev, p2m_dev);
+	spin_unlock_irqrestore(&p2m_dev->lock, flags);
+}
+
+int solo_p2m_submit(struct solo_dev *solo_dev, struct solo_p2m_req *req)
+{
+	struct solo_p2m_dev *p2m_dev;
+
+	if (WARN_ON_ONCE(req->desc_cnt < 1 || !req->complete))
+		return -EINVAL;
+	if (WARN_ON_ONCE(req->desc_cnt > SOLO_NR_P2M_DESC - 1))
+		return -EINVAL;
+	if (WARN_ON_ONCE(req->caller < 0 ||
+			 req->caller >= SOLO_P2M_NR_CALLERS))
+		return -EINVAL;
+
+	p2m_dev = &solo_dev->p2m_dev[solo_p2m_pick_engine(solo_dev)];
+	__solo_p2m_submit(solo_dev, p2m_dev, req);
+
+	return 0;
+}
+
+static void solo_p2m_sync_complete(struct solo_dev *solo_dev,
+				   struct solo_p2m_req *req)
+{
+	complete(req->priv);
+}
+
+int solo_p2m_dma_desc(struct solo_dev *solo_dev, int caller,
+		      struct solo_p2m_desc *desc, int desc_cnt)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct solo_p2m_req req = {
+		.desc		= desc,
+		.desc_cnt	= desc_cnt,
+		.caller		= caller,
+		.complete	= solo_p2m_sync_complete,
+		.priv		= &done,
+	};
+	int ret;
+
+	ret = solo_p2m_submit(solo_dev, &req);
+	if (ret)
+		return ret;
+
+	/* The engine timer guarantees that this completes */
+	wait_for_completion(&done);
+
+	WARN_ON_ONCE(req.error == -EIO);
+
+	return req.error;
 }
 
 void solo_p2m_fill_desc(struct solo_p2m_desc *desc, int wr,
@@ -155,7 +534,7 @@ void solo_p2m_fill_desc(struct solo_p2m_desc *desc, int wr,
 	desc->ext_addr = ext_addr;
 }
 
-int solo_p2m_dma_t(struct solo_dev *solo_dev, int wr,
+int solo_p2m_dma_t(struct solo_dev *solo_dev, int caller, int wr,
 		   dma_addr_t dma_addr, u32 ext_addr, u32 size,
 		   int repeat, u32 ext_size)
 {
@@ -164,35 +543,90 @@ int solo_p2m_dma_t(struct solo_dev *solo_dev, int wr,
 	solo_p2m_fill_desc(&desc[1], wr, dma_addr, ext_addr, size, repeat,
 			   ext_size);
 
-	/* No need for desc_dma since we know it is a single-shot */
-	return solo_p2m_dma_desc(solo_dev, desc, 0, 1);
+	return solo_p2m_dma_desc(solo_dev, caller, desc, 1);
+}
+
+/* Transfer to or from a circular region of SDRAM starting at base + off.
+ * A transfer that crosses the end of the ring is done as two transfers of
+ * their own, one after the other, rather than as one chain: awkwardly
+ * sized descriptors in a chain have been seen to time out
+ * (bluecherrydvr/solo6x10 issue #8). The trailing partial burst of an odd
+ * sized fragment may be what stalls the engine, but until that is shown
+ * on hardware the two halves stay apart. */
+int solo_p2m_dma_ring(struct solo_dev *solo_dev, int caller, int wr,
+		      dma_addr_t dma_addr, u32 base, u32 base_size,
+		      u32 off, u32 size)
+{
+	u32 left;
+	int ret;
+
+	if (off >= base_size)
+		off -= base_size;
+
+	left = base_size - off;
+
+	if (size <= left)
+		return solo_p2m_dma_t(solo_dev, caller, wr, dma_addr,
+				      base + off, size, 0, 0);
+
+	ret = solo_p2m_dma_t(solo_dev, caller, wr, dma_addr, base + off,
+			     left, 0, 0);
+	if (ret)
+		return ret;
+
+	return solo_p2m_dma_t(solo_dev, caller, wr, dma_addr + left, base,
+			      size - left, 0, 0);
 }
 
 void solo_p2m_isr(struct solo_dev *solo_dev, int id)
 {
 	struct solo_p2m_dev *p2m_dev = &solo_dev->p2m_dev[id];
-	struct solo_p2m_desc *desc;
+	struct solo_p2m_req *req, *tmp;
+	LIST_HEAD(done);
 
-	if (p2m_dev->desc_count <= p2m_dev->desc_idx) {
-		complete(&p2m_dev->completion);
-		return;
+	spin_lock(&p2m_dev->lock);
+
+	if (p2m_dev->desc_mode) {
+		/* We only get interrupted once the ring has drained */
+		p2m_dev->head = p2m_dev->tail;
+		list_splice_tail_init(&p2m_dev->active, &done);
+	} else {
+		/* Retire whatever ended on the descriptor that just finished */
+		list_for_each_entry_safe(req, tmp, &p2m_dev->active, list) {
+			if (req->ring_end != p2m_dev->head)
+				break;
+			list_move_tail(&req->list, &done);
+		}
+
+		if (p2m_dev->head != p2m_dev->tail) {
+			/* Setup next descriptor */
+			p2m_dev->head = solo_p2m_ring_next(p2m_dev->head);
+			solo_p2m_write_desc(solo_dev, id,
+					    &p2m_dev->ring[p2m_dev->head]);
+			p2m_dev->deadline = jiffies + solo_dev->p2m_jiffies;
+			mod_timer(&p2m_dev->timer, p2m_dev->deadline);
+		}
+	}
+
+	solo_p2m_account_done(p2m_dev, &done);
+
+	if (list_empty(&p2m_dev->active)) {
+		del_timer(&p2m_dev->timer);
+		if (!p2m_dev->desc_mode)
+			solo_reg_write(solo_dev, SOLO_P2M_CONTROL(id), 0);
+		solo_p2m_start_next(solo_dev, p2m_dev);
 	}
 
-	/* Setup next descriptor */
-	p2m_dev->desc_idx++;
-	desc = &p2m_dev->descs[p2m_dev->desc_idx];
+	spin_unlock(&p2m_dev->lock);
 
-	solo_reg_write(solo_dev, SOLO_P2M_CONTROL(id), 0);
-	solo_reg_write(solo_dev, SOLO_P2M_TAR_ADR(id), desc->dma_addr);
-	solo_reg_write(solo_dev, SOLO_P2M_EXT_ADR(id), desc->ext_addr);
-	solo_reg_write(solo_dev, SOLO_P2M_EXT_CFG(id), desc->cfg);
-	solo_reg_write(solo_dev, SOLO_P2M_CONTROL(id), desc->ctrl);
+	solo_p2m_complete_list(solo_dev, &done);
 }
 
 void solo_p2m_error_isr(struct solo_dev *solo_dev)
 {
 	unsigned int err = solo_reg_read(solo_dev, SOLO_PCI_ERR);
 	struct solo_p2m_dev *p2m_dev;
+	LIST_HEAD(done);
 	int i;
 
 	if (!(err & SOLO_PCI_ERR_P2M))
@@ -200,18 +634,563 @@ void solo_p2m_error_isr(struct solo_dev *solo_dev)
 
 	for (i = 0; i < SOLO_NR_P2M; i++) {
 		p2m_dev = &solo_dev->p2m_dev[i];
-		p2m_dev->error = 1;
-		solo_reg_write(solo_dev, SOLO_P2M_CONTROL(i), 0);
-		complete(&p2m_dev->completion);
+
+		spin_lock(&p2m_dev->lock);
+		solo_p2m_abort(solo_dev, p2m_dev, -EIO, &done);
+		spin_unlock(&p2m_dev->lock);
 	}
+
+	solo_p2m_complete_list(solo_dev, &done);
 }
 
-void solo_p2m_exit(struct solo_dev *solo_dev)
+ssize_t solo_p2m_show_engines(struct solo_dev *solo_dev, char *buf)
+{
+	struct solo_p2m_dev *p2m_dev;
+	unsigned long flags;
+	char *out = buf;
+	int i;
+
+	for (i = 0; i < SOLO_NR_P2M; i++) {
+		unsigned int outstanding;
+		unsigned long queued;
+		u64 reqs, bytes, busy_ns;
+
+		p2m_dev = &solo_dev->p2m_dev[i];
+
+		spin_lock_irqsave(&p2m_dev->lock, flags);
+		outstanding = p2m_dev->outstanding;
+		queued = p2m_dev->queued_bytes;
+		reqs = p2m_dev->total_reqs;
+		bytes = p2m_dev->total_bytes;
+		busy_ns = p2m_dev->busy_ns;
+		if (p2m_dev->busy)
+			busy_ns += ktime_to_ns(ktime_sub(ktime_get(),
+						 p2m_dev->busy_start));
+		spin_unlock_irqrestore(&p2m_dev->lock, flags);
+
+		out += sprintf(out, "P2M%d: %s reqs %llu bytes %llu "
+			       "busy %llums outstanding %u (%lu bytes)\n", i,
+			       p2m_dev->desc_mode ? "desc" : "reg",
+			       (unsigned long long)reqs,
+			       (unsigned long long)bytes,
+			       (unsigned long long)div_u64(busy_ns,
+							   NSEC_PER_MSEC),
+			       outstanding, queued);
+	}
+
+	out += sprintf(out, "bounce pool misses %u\n",
+		       READ_ONCE(solo_dev->p2m_pool_misses));
+
+	return out - buf;
+}
+
+static const char *solo_p2m_caller_names[SOLO_P2M_NR_CALLERS] = {
+	[SOLO_P2M_CALLER_MPEG]		= "mpeg",
+	[SOLO_P2M_CALLER_JPEG]		= "jpeg",
+	[SOLO_P2M_CALLER_HEADER]	= "header",
+	[SOLO_P2M_CALLER_OSD]		= "osd",
+	[SOLO_P2M_CALLER_MOTION]	= "motion",
+	[SOLO_P2M_CALLER_AUDIO]		= "audio",
+	[SOLO_P2M_CALLER_DISPLAY]	= "display",
+	[SOLO_P2M_CALLER_SDRAM]		= "sdram",
+};
+
+static void solo_p2m_seq_hist(struct seq_file *m, const char *name,
+			      const u32 *hist)
 {
 	int i;
 
+	seq_printf(m, "  %-8s", name);
+	for (i = 0; i < SOLO_P2M_HIST_BUCKETS; i++)
+		seq_printf(m, " %u", hist[i]);
+	seq_putc(m, '\n');
+}
+
+static int solo_p2m_stats_show(struct seq_file *m, void *v)
+{
+	struct solo_dev *solo_dev = m->private;
+	struct solo_p2m_stats *st;
+	int i, j;
+
+	st = kmalloc(sizeof(*st), GFP_KERNEL);
+	if (st == NULL)
+		return -ENOMEM;
+
+	seq_puts(m, "# bucket n counts values below 2^n, the last is open "
+		 "ended\n# lat_us in microseconds, size in 64 byte units\n");
+
+	for (i = 0; i < SOLO_NR_P2M; i++) {
+		struct solo_p2m_dev *p2m_dev = &solo_dev->p2m_dev[i];
+
+		for (j = 0; j < SOLO_P2M_NR_CALLERS; j++) {
+			unsigned long flags;
+
+			spin_lock_irqsave(&p2m_dev->lock, flags);
+			*st = p2m_dev->stats[j];
+			spin_unlock_irqrestore(&p2m_dev->lock, flags);
+
+			if (!st->reqs)
+				continue;
+
+			seq_printf(m, "P2M%d %s: reqs %llu bytes %llu "
+				   "errors %u timeouts %u\n", i,
+				   solo_p2m_caller_names[j],
+				   (unsigned long long)st->reqs,
+				   (unsigned long long)st->bytes,
+				   st->errors, st->timeouts);
+			solo_p2m_seq_hist(m, "lat_us", st->lat_us);
+			solo_p2m_seq_hist(m, "size", st->size);
+			solo_p2m_seq_hist(m, "descs", st->descs);
+		}
+	}
+
+	kfree(st);
+
+	return 0;
+}
+
+static int solo_p2m_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, solo_p2m_stats_show, inode->i_private);
+}
+
+static const struct file_operations solo_p2m_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= solo_p2m_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Any write clears the statistics of every engine */
+static ssize_t solo_p2m_stats_reset(struct file *file,
+				    const char __user *buf, size_t count,
+				    loff_t *ppos)
+{
+	struct solo_dev *solo_dev = file->private_data;
+	int i;
+
+	for (i = 0; i < SOLO_NR_P2M; i++) {
+		struct solo_p2m_dev *p2m_dev = &solo_dev->p2m_dev[i];
+		unsigned long flags;
+
+		spin_lock_irqsave(&p2m_dev->lock, flags);
+		memset(p2m_dev->stats, 0, sizeof(p2m_dev->stats));
+		spin_unlock_irqrestore(&p2m_dev->lock, flags);
+	}
+
+	return count;
+}
+
+static int solo_p2m_reset_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+static const struct file_operations solo_p2m_reset_fops = {
+	.owner		= THIS_MODULE,
+	.open		= solo_p2m_reset_open,
+	.write		= solo_p2m_stats_reset,
+};
+
+/* On-demand bandwidth benchmark. Each point runs SOLO_P2M_BENCH_ITERS
+ * waves of one read per engine, from a private slot of the MP4E ring, so
+ * the encoders must be idle while it runs. */
+#define SOLO_P2M_BENCH_ITERS	32
+#define SOLO_P2M_BENCH_MAX	0x20000
+#define SOLO_P2M_BENCH_LINE	1024
+/* Tries of solo_p2m_set_desc_mode() to put an engine back afterwards */
+#define SOLO_P2M_BENCH_RESTORE	100
+
+static const u32 solo_p2m_bench_sizes[] = {
+	256, 1024, 4096, 16384, 65536, SOLO_P2M_BENCH_MAX,
+};
+
+static const u8 solo_p2m_bench_bursts[] = {
+	SOLO_P2M_BURST_512, SOLO_P2M_BURST_256, SOLO_P2M_BURST_128,
+	SOLO_P2M_BURST_64, SOLO_P2M_BURST_32,
+};
+
+static const u8 solo_p2m_bench_engines[] = { 1, 2, SOLO_NR_P2M };
+
+#define SOLO_P2M_BENCH_POINTS	(2 * ARRAY_SIZE(solo_p2m_bench_engines) * \
+				 ARRAY_SIZE(solo_p2m_bench_bursts) * 2 * \
+				 ARRAY_SIZE(solo_p2m_bench_sizes))
+
+struct solo_p2m_bench_req {
+	struct solo_p2m_req	req;
+	struct solo_p2m_desc	desc[2];
+	ktime_t			done;
+};
+
+struct solo_p2m_bench_wave {
+	atomic_t		pending;
+	struct completion	done;
+};
+
+static void solo_p2m_bench_complete(struct solo_dev *solo_dev,
+				    struct solo_p2m_req *req)
+{
+	struct solo_p2m_bench_req *breq =
+		container_of(req, struct solo_p2m_bench_req, req);
+	struct solo_p2m_bench_wave *wave = req->priv;
+
+	breq->done = ktime_get();
+	if (atomic_dec_and_test(&wave->pending))
+		complete(&wave->done);
+}
+
+/* Only for when the engine is idle. Mirrors the setup in solo_p2m_init() */
+static int solo_p2m_set_desc_mode(struct solo_dev *solo_dev,
+				  struct solo_p2m_dev *p2m_dev, int on)
+{
+	unsigned long flags;
+	int tries;
+
+	for (tries = 0; tries < 10; tries++) {
+		spin_lock_irqsave(&p2m_dev->lock, flags);
+		if (list_empty(&p2m_dev->active) &&
+		    list_empty(&p2m_dev->pending)) {
+			p2m_dev->desc_mode = on;
+			solo_reg_write(solo_dev, SOLO_P2M_CONFIG(p2m_dev->id),
+				       p2m_dev->config);
+			solo_p2m_ring_reset(solo_dev, p2m_dev);
+			if (on)
+				solo_reg_write(solo_dev,
+					       SOLO_P2M_CONFIG(p2m_dev->id),
+					       p2m_dev->config |
+					       SOLO_P2M_DESC_MODE);
+			spin_unlock_irqrestore(&p2m_dev->lock, flags);
+			return 0;
+		}
+		spin_unlock_irqrestore(&p2m_dev->lock, flags);
+		msleep(1);
+	}
+
+	return -EBUSY;
+}
+
+static int solo_p2m_bench_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void solo_p2m_bench_point(struct solo_dev *solo_dev,
+				 struct solo_p2m_bench_result *res,
+				 struct solo_p2m_bench_req *breq, u32 *lat,
+				 dma_addr_t dma)
+{
+	struct solo_p2m_bench_wave wave;
+	int nr = SOLO_P2M_BENCH_ITERS * res->engines;
+	u64 bytes = 0;
+	ktime_t start;
+	s64 us;
+	int i, j;
+
+	start = ktime_get();
+
+	for (i = 0; i < SOLO_P2M_BENCH_ITERS; i++) {
+		atomic_set(&wave.pending, res->engines);
+		init_completion(&wave.done);
+
+		for (j = 0; j < res->engines; j++) {
+			struct solo_p2m_desc *desc = &breq[j].desc[1];
+			u32 ext = SOLO_MP4E_EXT_ADDR(solo_dev) +
+				j * 2 * SOLO_P2M_BENCH_MAX;
+
+			if (res->stride) {
+				u32 line = min_t(u32, res->size,
+						 SOLO_P2M_BENCH_LINE);
+
+				solo_p2m_fill_desc(desc, 0, dma, ext, line,
+						   res->size / line, line * 2);
+			} else {
+				solo_p2m_fill_desc(desc, 0, dma, ext,
+						   res->size, 0, 0);
+			}
+			desc->ctrl &= ~SOLO_P2M_BURST_SIZE(7);
+			desc->ctrl |= SOLO_P2M_BURST_SIZE(res->burst);
+
+			breq[j].req.desc = breq[j].desc;
+			breq[j].req.desc_cnt = 1;
+			breq[j].req.caller = SOLO_P2M_CALLER_SDRAM;
+			breq[j].req.complete = solo_p2m_bench_complete;
+			breq[j].req.priv = &wave;
+
+			__solo_p2m_submit(solo_dev, &solo_dev->p2m_dev[j],
+					  &breq[j].req);
+		}
+
+		wait_for_completion(&wave.done);
+
+		for (j = 0; j < res->engines; j++) {
+			if (breq[j].req.error && !res->error)
+				res->error = breq[j].req.error;
+			bytes += breq[j].req.bytes;
+			lat[i * res->engines + j] =
+				ktime_us_delta(breq[j].done,
+					       breq[j].req.submitted);
+		}
+	}
+
+	us = max_t(s64, ktime_us_delta(ktime_get(), start), 1);
+	res->mbps10 = div64_u64(bytes * 10, us);
+
+	sort(lat, nr, sizeof(*lat), solo_p2m_bench_cmp, NULL);
+	res->lat_us[0] = lat[nr / 2];
+	res->lat_us[1] = lat[nr * 90 / 100];
+	res->lat_us[2] = lat[nr * 99 / 100];
+	res->lat_us[3] = lat[nr - 1];
+}
+
+/* Runs every engine count, burst size, linear vs. strided (repeat mode)
+ * layout and transfer size in the current DMA mode */
+static struct solo_p2m_bench_result *solo_p2m_bench_sweep(
+		struct solo_dev *solo_dev, struct solo_p2m_bench_result *res,
+		int mode, int max_engines, struct solo_p2m_bench_req *breq,
+		u32 *lat, dma_addr_t dma)
+{
+	int e, b, stride, sz;
+
+	for (e = 0; e < ARRAY_SIZE(solo_p2m_bench_engines); e++) {
+		if (solo_p2m_bench_engines[e] > max_engines)
+			break;
+
+		for (b = 0; b < ARRAY_SIZE(solo_p2m_bench_bursts); b++) {
+			for (stride = 0; stride < 2; stride++) {
+				for (sz = 0;
+				     sz < ARRAY_SIZE(solo_p2m_bench_sizes);
+				     sz++, res++) {
+					res->desc_mode = mode;
+					res->engines =
+						solo_p2m_bench_engines[e];
+					res->burst = solo_p2m_bench_bursts[b];
+					res->stride = stride;
+					res->size = solo_p2m_bench_sizes[sz];
+
+					solo_p2m_bench_point(solo_dev, res,
+							     breq, lat, dma);
+				}
+			}
+		}
+	}
+
+	return res;
+}
+
+/* Sweeps descriptor vs. register mode, then everything else in
+ * solo_p2m_bench_sweep() for each. */
+static int solo_p2m_bench_run(struct solo_dev *solo_dev)
+{
+	struct solo_p2m_bench_result *results, *res;
+	struct solo_p2m_bench_req *breq;
+	int saved_mode[SOLO_NR_P2M];
+	int nr_modes, max_engines;
+	dma_addr_t dma;
+	void *buf;
+	u32 *lat;
+	int mode, i;
+	int ret = 0;
+
+	/* solo_ring_start() takes p2m_bench_lock too, so no encoder can
+	 * start until we are done */
+	BUG_ON(!mutex_is_locked(&solo_dev->p2m_bench_lock));
+
+	if (atomic_read(&solo_dev->enc_users))
+		return -EBUSY;
+
+	/* According to Softlogic, 6110 has problems on !=0 P2M */
+	nr_modes = solo_dev->type == SOLO_DEV_6110 ? 1 : 2;
+	max_engines = solo_dev->type == SOLO_DEV_6110 ? 1 : SOLO_NR_P2M;
+
+	results = kcalloc(SOLO_P2M_BENCH_POINTS, sizeof(*results),
+			  GFP_KERNEL);
+	breq = kcalloc(SOLO_NR_P2M, sizeof(*breq), GFP_KERNEL);
+	lat = kcalloc(SOLO_P2M_BENCH_ITERS * SOLO_NR_P2M, sizeof(*lat),
+		      GFP_KERNEL);
+	buf = pci_alloc_consistent(solo_dev->pdev, SOLO_P2M_BENCH_MAX, &dma);
+	if (!results || !breq || !lat || !buf) {
+		ret = -ENOMEM;
+		goto bench_out;
+	}
+
 	for (i = 0; i < SOLO_NR_P2M; i++)
+		saved_mode[i] = solo_dev->p2m_dev[i].desc_mode;
+
+	res = results;
+	for (mode = nr_modes - 1; mode >= 0 && !ret; mode--) {
+		for (i = 0; i < max_engines && !ret; i++)
+			ret = solo_p2m_set_desc_mode(solo_dev,
+						     &solo_dev->p2m_dev[i],
+						     mode);
+		if (!ret)
+			res = solo_p2m_bench_sweep(solo_dev, res, mode,
+						   max_engines, breq, lat,
+						   dma);
+	}
+
+	/* Display and OSD traffic can keep an engine busy for a while, but
+	 * it must not be left in the wrong mode */
+	for (i = 0; i < max_engines; i++) {
+		int tries = 0;
+		int err;
+
+		do {
+			err = solo_p2m_set_desc_mode(solo_dev,
+						     &solo_dev->p2m_dev[i],
+						     saved_mode[i]);
+		} while (err && ++tries < SOLO_P2M_BENCH_RESTORE);
+
+		if (err) {
+			dev_err(&solo_dev->pdev->dev,
+				"Could not put P2M %d back in %s mode\n",
+				i, saved_mode[i] ? "descriptor" : "register");
+			if (!ret)
+				ret = err;
+		}
+	}
+
+	if (!ret) {
+		kfree(solo_dev->p2m_bench);
+		solo_dev->p2m_bench = results;
+		solo_dev->p2m_bench_nr = res - results;
+		results = NULL;
+	}
+
+bench_out:
+	if (buf)
+		pci_free_consistent(solo_dev->pdev, SOLO_P2M_BENCH_MAX,
+				    buf, dma);
+	kfree(lat);
+	kfree(breq);
+	kfree(results);
+
+	return ret;
+}
+
+static const char *solo_p2m_burst_names[] = {
+	[SOLO_P2M_BURST_512]	= "512",
+	[SOLO_P2M_BURST_256]	= "256",
+	[SOLO_P2M_BURST_128]	= "128",
+	[SOLO_P2M_BURST_64]	= "64",
+	[SOLO_P2M_BURST_32]	= "32",
+};
+
+static int solo_p2m_bench_show(struct seq_file *m, void *v)
+{
+	struct solo_dev *solo_dev = m->private;
+	struct solo_p2m_bench_result *res;
+	int i;
+
+	mutex_lock(&solo_dev->p2m_bench_lock);
+
+	if (!solo_dev->p2m_bench) {
+		seq_puts(m, "# no results, write to this file to run\n");
+		goto show_out;
+	}
+
+	seq_puts(m, "# mode engines burst layout size MB/s "
+		 "p50 p90 p99 max (us)\n");
+
+	for (i = 0; i < solo_dev->p2m_bench_nr; i++) {
+		res = &solo_dev->p2m_bench[i];
+
+		seq_printf(m, "%s %u %s %s %u ",
+			   res->desc_mode ? "desc" : "reg", res->engines,
+			   solo_p2m_burst_names[res->burst],
+			   res->stride ? "stride" : "linear", res->size);
+
+		if (res->error)
+			seq_printf(m, "error %d\n", res->error);
+		else
+			seq_printf(m, "%u.%u %u %u %u %u\n",
+				   res->mbps10 / 10, res->mbps10 % 10,
+				   res->lat_us[0], res->lat_us[1],
+				   res->lat_us[2], res->lat_us[3]);
+	}
+
+show_out:
+	mutex_unlock(&solo_dev->p2m_bench_lock);
+
+	return 0;
+}
+
+static int solo_p2m_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, solo_p2m_bench_show, inode->i_private);
+}
+
+/* Any write runs the benchmark, which takes a few seconds */
+static ssize_t solo_p2m_bench_write(struct file *file,
+				    const char __user *buf, size_t count,
+				    loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct solo_dev *solo_dev = m->private;
+	int ret;
+
+	mutex_lock(&solo_dev->p2m_bench_lock);
+	ret = solo_p2m_bench_run(solo_dev);
+	mutex_unlock(&solo_dev->p2m_bench_lock);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations solo_p2m_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= solo_p2m_bench_open,
+	.read		= seq_read,
+	.write		= solo_p2m_bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+void solo_p2m_debugfs_init(struct solo_dev *solo_dev)
+{
+	if (!solo_dev->debugfs)
+		return;
+
+	debugfs_create_file("p2m_stats", S_IRUGO, solo_dev->debugfs,
+			    solo_dev, &solo_p2m_stats_fops);
+	debugfs_create_file("p2m_stats_reset", S_IWUSR, solo_dev->debugfs,
+			    solo_dev, &solo_p2m_reset_fops);
+	debugfs_create_file("p2m_bench", S_IRUGO | S_IWUSR, solo_dev->debugfs,
+			    solo_dev, &solo_p2m_bench_fops);
+}
+
+void solo_p2m_exit(struct solo_dev *solo_dev)
+{
+	struct solo_p2m_dev *p2m_dev;
+	int i;
+
+	for (i = 0; i < SOLO_NR_P2M; i++) {
+		p2m_dev = &solo_dev->p2m_dev[i];
+
 		solo_irq_off(solo_dev, SOLO_IRQ_P2M(i));
+
+		/* solo_p2m_init() never got to this engine */
+		if (!p2m_dev->solo_dev)
+			continue;
+
+		del_timer_sync(&p2m_dev->timer);
+		solo_reg_write(solo_dev, SOLO_P2M_CONTROL(i), 0);
+
+		if (!p2m_dev->ring)
+			continue;
+
+		solo_reg_write(solo_dev, SOLO_P2M_CONFIG(i), p2m_dev->config);
+		pci_free_consistent(solo_dev->pdev, SOLO_P2M_DESC_SIZE,
+				    p2m_dev->ring, p2m_dev->ring_dma);
+		p2m_dev->ring = NULL;
+	}
+
+	solo_p2m_pool_free(solo_dev);
+
+	kfree(solo_dev->p2m_bench);
+	solo_dev->p2m_bench = NULL;
 }
 
 static int solo_p2m_test(struct solo_dev *solo_dev, int base, int size)
@@ -240,10 +1219,12 @@ static int solo_p2m_test(struct solo_dev *solo_dev, int base, int size)
 
 	memset(rd_buf, 0x55, size);
 
-	if (solo_p2m_dma(solo_dev, 1, wr_buf, base, size, 0, 0))
+	if (solo_p2m_dma(solo_dev, SOLO_P2M_CALLER_SDRAM, 1, wr_buf, base,
+			 size, 0, 0))
 		goto test_fail;
 
-	if (solo_p2m_dma(solo_dev, 0, rd_buf, base, size, 0, 0))
+	if (solo_p2m_dma(solo_dev, SOLO_P2M_CALLER_SDRAM, 0, rd_buf, base,
+			 size, 0, 0))
 		goto test_fail;
 
 	for (i = 0; i < (size >> 2); i++) {
@@ -265,18 +1246,43 @@ int solo_p2m_init(struct solo_dev *solo_dev)
 	struct solo_p2m_dev *p2m_dev;
 	int i;
 
+	mutex_init(&solo_dev->p2m_bench_lock);
+
+	if (solo_p2m_pool_init(solo_dev))
+		return -ENOMEM;
+
 	for (i = 0; i < SOLO_NR_P2M; i++) {
 		p2m_dev = &solo_dev->p2m_dev[i];
 
-		mutex_init(&p2m_dev->mutex);
-		init_completion(&p2m_dev->completion);
+		p2m_dev->solo_dev = solo_dev;
+		p2m_dev->id = i;
+		spin_lock_init(&p2m_dev->lock);
+		INIT_LIST_HEAD(&p2m_dev->pending);
+		INIT_LIST_HEAD(&p2m_dev->active);
+		timer_setup(&p2m_dev->timer, solo_p2m_timeout, 0);
+
+		/* The ring lives for as long as the device. In register mode
+		 * it is only walked by the ISR, but it still lets callers
+		 * hand off their descriptors at submit time. */
+		p2m_dev->ring = pci_alloc_consistent(solo_dev->pdev,
+						     SOLO_P2M_DESC_SIZE,
+						     &p2m_dev->ring_dma);
+		if (p2m_dev->ring == NULL)
+			return -ENOMEM;
+
+		p2m_dev->desc_mode = solo_dev->type != SOLO_DEV_6110 &&
+			desc_mode;
+		p2m_dev->config = SOLO_P2M_CSC_16BIT_565 |
+			SOLO_P2M_DESC_INTR_OPT |
+			SOLO_P2M_DMA_INTERVAL(0) |
+			SOLO_P2M_PCI_MASTER_MODE;
 
 		solo_reg_write(solo_dev, SOLO_P2M_CONTROL(i), 0);
-		solo_reg_write(solo_dev, SOLO_P2M_CONFIG(i),
-			       SOLO_P2M_CSC_16BIT_565 |
-			       SOLO_P2M_DESC_INTR_OPT |
-			       SOLO_P2M_DMA_INTERVAL(0) |
-			       SOLO_P2M_PCI_MASTER_MODE);
+		solo_reg_write(solo_dev, SOLO_P2M_CONFIG(i), p2m_dev->config);
+		solo_p2m_ring_reset(solo_dev, p2m_dev);
+		if (p2m_dev->desc_mode)
+			solo_reg_write(solo_dev, SOLO_P2M_CONFIG(i),
+				       p2m_dev->config | SOLO_P2M_DESC_MODE);
 		solo_irq_on(solo_dev, SOLO_IRQ_P2M(i));
 	}
 
@@ -319,12 +1325,5 @@ int solo_p2m_init(struct solo_dev *solo_dev)
 		return -EIO;
 	}
 
-	if (SOLO_SDRAM_END(solo_dev) > solo_dev->sdram_size) {
-		dev_err(&solo_dev->pdev->dev,
-			"SDRAM is not large enough (%u < %u)\n",
-			solo_dev->sdram_size, SOLO_SDRAM_END(solo_dev));
-		return -EIO;
-	}
-
 	return 0;
 }
@@ -34,9 +34,14 @@
 #include <linux/stringify.h>
 #include <linux/io.h>
 #include <linux/atomic.h>
+#include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
 
 #include <linux/videodev2.h>
 #include <media/v4l2-dev.h>
+#include <media/v4l2-device.h>
+#include <media/v4l2-ctrls.h>
 #include <media/videobuf-core.h>
 
 #include "registers.h"
@@ -108,12 +113,111 @@
 #define V4L2_BUF_FLAG_MOTION_ON		0x0400
 #define V4L2_BUF_FLAG_MOTION_DETECTED	0x0800
 #endif
+/* Timecode userbits on frames from the all-channel encoder node */
+#define SOLO_ENC_MUX_UB_CH		0
+#define SOLO_ENC_MUX_UB_TYPE		1
+/* Bitstream ring mode for the encoder nodes. VIDIOC_SOLO_RING_SETUP
+ * allocates the ring and starts the encoder, a data_size of 0 tears it
+ * down. Mapping mmap_size bytes at mmap_offset gives the control block,
+ * then the index entries at idx_offset, then the frame data at
+ * data_offset. The driver appends entries at idx_head; userspace consumes
+ * them and advances idx_tail. */
+#define SOLO_ENC_RING_MMAP_OFF		0x40000000
+
+struct solo_enc_ring_setup {
+	__u32	data_size;
+	__u32	nr_index;
+	__u32	mmap_offset;
+	__u32	mmap_size;
+};
+
+struct solo_enc_ring_ctl {
+	__u32	data_size;
+	__u32	nr_index;
+	__u32	idx_offset;
+	__u32	data_offset;
+	__u32	idx_head;
+	__u32	idx_tail;
+	__u32	dropped;
+	__u32	sequence;
+};
+
+struct solo_enc_ring_idx {
+	__u32	offset;
+	__u32	size;
+	__u32	flags;
+	__u16	channel;
+	__u16	type;
+	__u64	timestamp;
+	__u32	sequence;
+	__u32	reserved;
+};
+
+#define VIDIOC_SOLO_RING_SETUP	_IOWR('V', BASE_VIDIOC_PRIVATE + 0, \
+				      struct solo_enc_ring_setup)
+
+/* Pre-roll for event triggered recording. VIDIOC_SOLO_PREROLL_SETUP on a
+ * channel's encoder node keeps that channel encoding MPEG on the handle's
+ * stream, holding at least the last seconds of it in the driver starting
+ * from a keyframe, until called again with 0 seconds. It stays on after
+ * the handle is closed. frames and bytes return what is held now.
+ * VIDIOC_SOLO_PREROLL_DRAIN on a handle that isn't streaming yet makes
+ * its next STREAMON, or VIDIOC_SOLO_RING_SETUP, start with everything
+ * held before going on to live frames. */
+#define SOLO_ENC_PREROLL_MAX		60
+
+struct solo_enc_preroll {
+	__u32	seconds;
+	__u32	frames;
+	__u32	bytes;
+	__u32	reserved;
+};
+
+#define VIDIOC_SOLO_PREROLL_SETUP _IOWR('V', BASE_VIDIOC_PRIVATE + 1, \
+					struct solo_enc_preroll)
+#define VIDIOC_SOLO_PREROLL_DRAIN _IO('V', BASE_VIDIOC_PRIVATE + 2)
+
+/* Driver controls. Older applications use V4L2_CID_PRIVATE_BASE + n,
+ * which the control framework takes as the n-th driver control of the
+ * node, so every node registers all of 0 to n and the offsets below
+ * must stay as they are. See solo_ctrl_new_placeholder(). */
+#ifndef V4L2_CID_USER_SOLO6X10_BASE
+#define V4L2_CID_USER_SOLO6X10_BASE	(V4L2_CID_USER_BASE + 0x1000)
+#endif
+
 #ifndef V4L2_CID_MOTION_ENABLE
-#define PRIVATE_CIDS
-#define V4L2_CID_MOTION_ENABLE		(V4L2_CID_PRIVATE_BASE+0)
-#define V4L2_CID_MOTION_THRESHOLD	(V4L2_CID_PRIVATE_BASE+1)
-#define V4L2_CID_MOTION_TRACE		(V4L2_CID_PRIVATE_BASE+2)
+#define V4L2_CID_MOTION_ENABLE		(V4L2_CID_USER_SOLO6X10_BASE+0)
+#define V4L2_CID_MOTION_THRESHOLD	(V4L2_CID_USER_SOLO6X10_BASE+1)
+#define V4L2_CID_MOTION_TRACE		(V4L2_CID_USER_SOLO6X10_BASE+2)
+#endif
+
+/* Encoder node: with motion detection on, hold back everything but
+ * keyframes until there is motion, then deliver every frame for this
+ * many seconds after the last of it. 0 delivers every frame. */
+#ifndef V4L2_CID_MOTION_GATE
+#define V4L2_CID_MOTION_GATE		(V4L2_CID_USER_SOLO6X10_BASE+3)
+#endif
+#define SOLO_MOTION_GATE_MAX		3600
+
+/* Encoder node: how the encoder bandwidth is shared out when the active
+ * channels don't all fit at the frame rate they were set to. Channels of
+ * lower priority are slowed down first, but never below one frame per
+ * max interval. */
+#ifndef V4L2_CID_ENC_PRIORITY
+#define V4L2_CID_ENC_PRIORITY		(V4L2_CID_USER_SOLO6X10_BASE+4)
+#define V4L2_CID_ENC_MAX_INTERVAL	(V4L2_CID_USER_SOLO6X10_BASE+5)
+#endif
+#define SOLO_ENC_PRIORITY_MAX		7
+#define SOLO_ENC_PRIORITY_DEF		4
+#define SOLO_ENC_INTERVAL_MAX		15
+
+/* Encoder node: quantizer of the MPEG encoder, lower is better quality.
+ * Like the GOP size, a change on a running channel is taken at its next
+ * keyframe. */
+#ifndef V4L2_CID_ENC_QP
+#define V4L2_CID_ENC_QP			(V4L2_CID_USER_SOLO6X10_BASE+6)
 #endif
+#define SOLO_ENC_QP_MAX			31
 
 enum SOLO_I2C_STATE {
 	IIC_STATE_IDLE,
@@ -131,21 +235,223 @@ struct solo_p2m_desc {
 	u32	ext_addr;
 };
 
+/* Who a P2M transfer is for; only used for statistics */
+enum solo_p2m_caller {
+	SOLO_P2M_CALLER_MPEG = 0,
+	SOLO_P2M_CALLER_JPEG,
+	SOLO_P2M_CALLER_HEADER,
+	SOLO_P2M_CALLER_OSD,
+	SOLO_P2M_CALLER_MOTION,
+	SOLO_P2M_CALLER_AUDIO,
+	SOLO_P2M_CALLER_DISPLAY,
+	SOLO_P2M_CALLER_SDRAM,
+	SOLO_P2M_NR_CALLERS,
+};
+
+/* Bucket n counts values in [2^(n-1), 2^n), the last one is open ended */
+#define SOLO_P2M_HIST_BUCKETS	16
+
+struct solo_p2m_stats {
+	u64	reqs;
+	u64	bytes;
+	u32	errors;
+	u32	timeouts;
+	u32	lat_us[SOLO_P2M_HIST_BUCKETS];
+	u32	size[SOLO_P2M_HIST_BUCKETS];	/* In 64 byte units */
+	u32	descs[SOLO_P2M_HIST_BUCKETS];
+};
+
+struct solo_p2m_req;
+
+typedef void (*solo_p2m_complete_t)(struct solo_dev *solo_dev,
+				    struct solo_p2m_req *req);
+
+/* An asynchronous P2M request. As with solo_p2m_dma_desc(), desc[0] is
+ * unused and the chain is desc[1] through desc[desc_cnt]. Descriptors are
+ * copied into the engine's ring when the request is started, but must
+ * stay valid until complete() has been called, which happens from
+ * interrupt (or timer) context with req->error set. */
+struct solo_p2m_req {
+	struct list_head	list;
+	struct solo_p2m_desc	*desc;
+	int			desc_cnt;
+	int			error;
+	int			caller;
+	solo_p2m_complete_t	complete;
+	void			*priv;
+	/* Private to p2m.c */
+	unsigned int		ring_end;
+	unsigned int		bytes;
+	ktime_t			submitted;
+};
+
+/* Each engine owns a persistent ring of SOLO_NR_P2M_DESC descriptors.
+ * Requests are appended after tail and the hardware (or, in register
+ * mode, the ISR) walks them up to tail. Descriptor IDs are 8 bits, so
+ * the ring wraps at SOLO_NR_P2M_DESC. */
 struct solo_p2m_dev {
-	struct mutex		mutex;
-	struct completion	completion;
-	int			desc_count;
-	int			desc_idx;
-	struct solo_p2m_desc	*descs;
+	struct solo_dev		*solo_dev;
+	int			id;
+	int			desc_mode;
+	u32			config;
+	spinlock_t		lock;
+	struct list_head	pending;
+	struct list_head	active;
+	struct timer_list	timer;
+	unsigned long		deadline;
+	struct solo_p2m_desc	*ring;
+	dma_addr_t		ring_dma;
+	unsigned int		head;
+	unsigned int		tail;
+
+	/* Load and utilization accounting, under lock */
+	unsigned int		outstanding;
+	unsigned long		queued_bytes;
+	u64			total_reqs;
+	u64			total_bytes;
+	u64			busy_ns;
+	ktime_t			busy_start;
+	int			busy;
+	struct solo_p2m_stats	stats[SOLO_P2M_NR_CALLERS];
+};
+
+/* Software-owned registers that are only ever changed by the driver. Their
+ * last written value is kept in solo_dev->shadow[], so they can be updated
+ * without reading them back over PCI. */
+enum solo_shadow_reg {
+	SOLO_SHADOW_VE_OSD_CH = 0,
+	SOLO_SHADOW_GPIO_CONFIG_0,
+	SOLO_SHADOW_GPIO_CONFIG_1,
+	SOLO_SHADOW_GPIO_DATA_OUT,
+	SOLO_SHADOW_VI_MOT_ADR,
+	SOLO_NR_SHADOW,
+};
+
+/* One point of the P2M bandwidth benchmark */
+struct solo_p2m_bench_result {
+	u8			desc_mode;
+	u8			engines;
+	u8			burst;
+	u8			stride;
+	u32			size;
+	u32			mbps10;		/* MB/s * 10 */
+	u32			lat_us[4];	/* p50, p90, p99, max */
 	int			error;
 };
 
+/* Pre-mapped, coherent bounce buffers for solo_p2m_dma() */
+#define SOLO_P2M_POOL_CLASSES	3
+
+struct solo_p2m_bounce {
+	struct list_head	list;
+	void			*buf;
+	dma_addr_t		dma;
+	unsigned int		size;
+};
+
+/* The card's SDRAM map, in address order, see solo_layout_init() */
+enum solo_sdram_region_id {
+	SOLO_SDRAM_DISP,
+	SOLO_SDRAM_EOSD,
+	SOLO_SDRAM_MOTION,
+	SOLO_SDRAM_G723,
+	SOLO_SDRAM_CAP,
+	SOLO_SDRAM_EREF,
+	SOLO_SDRAM_MP4E,
+	SOLO_SDRAM_JPEG,
+	SOLO_SDRAM_NR_REGIONS
+};
+
+struct solo_sdram_region {
+	u32			addr;
+	u32			size;
+	u32			unit;		/* per channel/page, or 0 */
+};
+
+struct solo_layout {
+	struct solo_sdram_region region[SOLO_SDRAM_NR_REGIONS];
+	u32			end;
+};
+
 #define OSD_TEXT_MAX		44
 
+enum solo_enc_types {
+	SOLO_ENC_TYPE_STD,
+	SOLO_ENC_TYPE_EXT,
+};
+
+struct vop_header {
+	/* VE_STATUS0 */
+	u32 mpeg_size:20, sad_motion_flag:1, video_motion_flag:1, vop_type:2,
+		channel:5, source_fl:1, interlace:1, progressive:1;
+
+	/* VE_STATUS1 */
+	u32 vsize:8, hsize:8, last_queue:4, nop0:8, scale:4;
+
+	/* VE_STATUS2 */
+	u32 mpeg_off;
+
+	/* VE_STATUS3 */
+	u32 jpeg_off;
+
+	/* VE_STATUS4 */
+	u32 jpeg_size:20, interval:10, nop1:2;
+
+	/* VE_STATUS5/6 */
+	u32 sec, usec;
+
+	/* VE_STATUS7/8/9 */
+	u32 nop2[3];
+
+	/* VE_STATUS10 */
+	u32 mpeg_size_alt:20, nop3:12;
+
+	u32 end_nops[5];
+} __packed;
+
+/* An encoded frame as found on the hardware queue. seq counts every
+ * frame the channel produced on this stream, so frames dropped further
+ * on show up as gaps; ring_pos is where it started in the MPEG ring, in
+ * bytes written since the encoder started. */
+struct solo_enc_buf {
+	enum solo_enc_types	type;
+	struct vop_header	vh;
+	int			motion;
+	u32			seq;
+	u64			ring_pos;
+};
+
+/* Why a channel lost a frame. The first three mean the host fell
+ * behind, NOBUF means a consumer did. */
+enum solo_enc_drop {
+	SOLO_ENC_DROP_HEADER,		/* bad or unreadable VOP header */
+	SOLO_ENC_DROP_QUEUE,		/* channel worker a full queue behind */
+	SOLO_ENC_DROP_OVERWRITE,	/* overwritten in the ring before read */
+	SOLO_ENC_DROP_NOBUF,		/* a listener had no buffer queued */
+	SOLO_ENC_NR_DROPS
+};
+
+struct solo_enc_frame_buf;
+struct solo_enc_gop_frame;
+
+/* Frames waiting for a channel's worker, see solo_enc_work() */
+#define SOLO_ENC_FRAME_QS	16
+
+/* MPEG frames kept on one stream to get new readers going without
+ * waiting for the next keyframe: the GOP in progress, starting at key,
+ * and with a pre-roll set the whole GOPs before it. Oldest first. */
+struct solo_enc_gop {
+	struct list_head	frames;
+	struct solo_enc_gop_frame *key;
+	unsigned int		nr;
+	size_t			bytes;
+};
+
 struct solo_enc_dev {
 	struct solo_dev	*solo_dev;
 	/* V4L2 Items */
 	struct video_device	*vfd;
+	struct v4l2_ctrl_handler hdl;
 	/* General accounting */
 	struct mutex		enable_lock;
 	spinlock_t		motion_lock;
@@ -153,7 +459,16 @@ struct solo_enc_dev {
 	atomic_t		mpeg_readers;
 	u8			ch;
 	u8			mode, gop, qp, interlaced, interval;
-	u8			bw_weight;
+	/* Bandwidth scheduling: the interval the channel actually runs
+	 * at, the slowest it may be taken down to and its priority, see
+	 * solo_enc_sched(). vop_interval is what the VOP header says. */
+	u8			sched_interval, max_interval, priority;
+	u8			sched_on;
+	u8			vop_interval;
+	/* Interval, GOP or QP changed while running, see
+	 * solo_enc_reconf(). Set under either enable_lock or
+	 * enc_sched_lock, only cleared with both held. */
+	u8			reconf;
 	u16			motion_thresh;
 	u16			width;
 	u16			height;
@@ -171,6 +486,36 @@ struct solo_enc_dev {
 
 	/* File handles that are listening for buffers */
 	struct list_head	listeners;
+
+	/* Frames handed over by the ring thread */
+	spinlock_t		frame_lock;
+	struct solo_enc_buf	frames[SOLO_ENC_FRAME_QS];
+	unsigned int		frame_head;
+	unsigned int		frame_tail;
+	struct work_struct	work;
+
+	/* Copies of the last frame, MPEG and JPEG, owned by the worker */
+	struct solo_enc_frame_buf *fanout[2];
+
+	/* Cached frames and pre-roll seconds of each stream, under
+	 * enable_lock */
+	struct solo_enc_gop	gop[2];
+	unsigned int		preroll[2];
+
+	/* Motion gate: hold time in seconds, when motion was last seen,
+	 * and per stream, the first frame held back since the last one
+	 * that went out. Under enable_lock */
+	unsigned int		gate_hold;
+	u64			gate_motion;
+	u8			gate_held[2];
+	u32			gate_from[2];
+
+	/* This channel's slice of solo_dev->enc_desc */
+	struct solo_p2m_desc	*desc;
+
+	/* Frame sequence per stream, and what was lost on the way */
+	u32			seq[2];
+	atomic_t		drops[SOLO_ENC_NR_DROPS];
 };
 
 /* The SOLO6x10 PCI Device */
@@ -185,8 +530,12 @@ struct solo_dev {
 	int			nr_chans;
 	int			nr_ext;
 	u32			irq_mask;
+	spinlock_t		irq_lock;
+	u32			irq_pending;
 	u32			motion_mask;
 	spinlock_t		reg_io_lock;
+	spinlock_t		shadow_lock;
+	u32			shadow[SOLO_NR_SHADOW];
 
 	/* tw28xx accounting */
 	u8			tw2865, tw2864, tw2815;
@@ -207,9 +556,21 @@ struct solo_dev {
 	atomic_t		p2m_count;
 	int			p2m_jiffies;
 	unsigned int		p2m_timeouts;
+	spinlock_t		p2m_pool_lock;
+	struct list_head	p2m_pool[SOLO_P2M_POOL_CLASSES];
+	unsigned int		p2m_pool_misses;
+	struct mutex		p2m_bench_lock;
+	struct solo_p2m_bench_result *p2m_bench;
+	int			p2m_bench_nr;
+
+	struct dentry		*debugfs;
+
+	/* V4L2 items, the device is the parent of every node */
+	struct v4l2_device	v4l2_dev;
 
 	/* V4L2 Display items */
 	struct video_device	*vfd;
+	struct v4l2_ctrl_handler disp_hdl;
 	unsigned int		erasing;
 	unsigned int		frame_blank;
 	u8			cur_disp_ch;
@@ -217,9 +578,25 @@ struct solo_dev {
 
 	/* V4L2 Encoder items */
 	struct solo_enc_dev	*v4l2_enc[SOLO_MAX_CHANNELS];
-	u16			enc_bw_remain;
+	/* Encoder budget, and the lock for sharing it out */
+	u16			enc_bw;
+	struct mutex		enc_sched_lock;
+	/* All-channel node, and the handles streaming from it */
+	struct video_device	*enc_mux_vfd;
+	struct mutex		enc_mux_lock;
+	struct list_head	enc_mux_listeners;
+	/* Descriptor chains for the channel workers, one slice each */
+	struct solo_p2m_desc	*enc_desc;
 	/* IDX into hw mp4 encoder */
 	u8			enc_idx;
+	/* Where the ring thread last saw the hardware write the MPEG ring,
+	 * used to spot lost queue entries and overwritten frames */
+	atomic64_t		enc_ring_pos;
+	u32			enc_ring_off;
+	u32			enc_ring_len;
+	int			enc_ring_valid;
+	atomic_t		enc_hw_overruns;
+	atomic_t		enc_hdr_errors;
 
 	/* Current video settings */
 	u32			video_type;
@@ -241,11 +618,13 @@ struct solo_dev {
 	/* sysfs stuffs */
 	struct device		dev;
 	int			sdram_size;
+	struct solo_layout	layout;
 	struct bin_attribute	sdram_attr;
 	unsigned int		sys_config;
 
-	/* Ring thread */
+	/* Ring thread, and the workers it hands frames to */
 	struct task_struct	*ring_thread;
+	struct workqueue_struct	*enc_wq;
 	wait_queue_head_t	ring_thread_wait;
 	atomic_t		enc_users;
 	atomic_t		disp_users;
@@ -290,6 +669,39 @@ static inline void solo_reg_write(struct solo_dev *solo_dev, int reg,
 	spin_unlock_irqrestore(&solo_dev->reg_io_lock, flags);
 }
 
+/* Posted register writes: everything between solo_reg_batch_begin() and
+ * solo_reg_batch_commit() goes out under a single hold of reg_io_lock,
+ * with one PCI flush at the end instead of one per register. Nothing in
+ * between may sleep or use solo_reg_read()/solo_reg_write(). */
+static inline void solo_reg_batch_begin(struct solo_dev *solo_dev,
+					unsigned long *flags)
+{
+	spin_lock_irqsave(&solo_dev->reg_io_lock, *flags);
+}
+
+static inline void solo_reg_batch_write(struct solo_dev *solo_dev, int reg,
+					u32 data)
+{
+	writel(data, solo_dev->reg_base + reg);
+}
+
+static inline void solo_reg_batch_commit(struct solo_dev *solo_dev,
+					 unsigned long flags)
+{
+	u16 val;
+
+	wmb();
+	pci_read_config_word(solo_dev->pdev, PCI_STATUS, &val);
+	rmb();
+
+	spin_unlock_irqrestore(&solo_dev->reg_io_lock, flags);
+}
+
+static inline u32 solo_shadow_read(struct solo_dev *solo_dev, int idx)
+{
+	return READ_ONCE(solo_dev->shadow[idx]);
+}
+
 static inline void solo_irq_on(struct solo_dev *dev, u32 mask)
 {
 	dev->irq_mask |= mask;
@@ -317,12 +729,14 @@ void solo_p2m_exit(struct solo_dev *solo_dev);
 
 int solo_v4l2_init(struct solo_dev *solo_dev, unsigned nr);
 void solo_v4l2_exit(struct solo_dev *solo_dev);
+void solo_ctrl_new_placeholder(struct v4l2_ctrl_handler *hdl, u32 id);
 
 int solo_enc_init(struct solo_dev *solo_dev);
 void solo_enc_exit(struct solo_dev *solo_dev);
 
 int solo_enc_v4l2_init(struct solo_dev *solo_dev, unsigned nr);
 void solo_enc_v4l2_exit(struct solo_dev *solo_dev);
+ssize_t solo_enc_drops_show(struct solo_dev *solo_dev, char *buf);
 
 int solo_g723_init(struct solo_dev *solo_dev);
 void solo_g723_exit(struct solo_dev *solo_dev);
@@ -336,24 +750,35 @@ void solo_g723_isr(struct solo_dev *solo_dev);
 void solo_motion_isr(struct solo_dev *solo_dev);
 void solo_video_in_isr(struct solo_dev *solo_dev);
 
+/* Shadowed registers */
+void solo_shadow_init(struct solo_dev *solo_dev);
+u32 solo_shadow_update(struct solo_dev *solo_dev, int idx, u32 clear,
+		       u32 set);
+void solo_shadow_write(struct solo_dev *solo_dev, int idx, u32 val);
+
 /* i2c read/write */
 u8 solo_i2c_readbyte(struct solo_dev *solo_dev, int id, u8 addr, u8 off);
 void solo_i2c_writebyte(struct solo_dev *solo_dev, int id, u8 addr, u8 off,
 			u8 data);
 
 /* P2M DMA */
-int solo_p2m_dma_t(struct solo_dev *solo_dev, int wr,
+int solo_p2m_dma_t(struct solo_dev *solo_dev, int caller, int wr,
 		   dma_addr_t dma_addr, u32 ext_addr, u32 size,
 		   int repeat, u32 ext_size);
-int solo_p2m_dma(struct solo_dev *solo_dev, int wr,
+int solo_p2m_dma(struct solo_dev *solo_dev, int caller, int wr,
 		 void *sys_addr, u32 ext_addr, u32 size,
 		 int repeat, u32 ext_size);
 void solo_p2m_fill_desc(struct solo_p2m_desc *desc, int wr,
 			dma_addr_t dma_addr, u32 ext_addr, u32 size,
 			int repeat, u32 ext_size);
-int solo_p2m_dma_desc(struct solo_dev *solo_dev,
-		      struct solo_p2m_desc *desc, dma_addr_t desc_dma,
-		      int desc_cnt);
+int solo_p2m_dma_ring(struct solo_dev *solo_dev, int caller, int wr,
+		      dma_addr_t dma_addr, u32 base, u32 base_size,
+		      u32 off, u32 size);
+int solo_p2m_dma_desc(struct solo_dev *solo_dev, int caller,
+		      struct solo_p2m_desc *desc, int desc_cnt);
+int solo_p2m_submit(struct solo_dev *solo_dev, struct solo_p2m_req *req);
+ssize_t solo_p2m_show_engines(struct solo_dev *solo_dev, char *buf);
+void solo_p2m_debugfs_init(struct solo_dev *solo_dev);
 
 /* Set the threshold for motion detection */
 int solo_set_motion_threshold(struct solo_dev *solo_dev, u8 ch, u16 val);
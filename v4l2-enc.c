@@ -26,45 +26,127 @@
 #include <linux/module.h>
 #include <linux/kthread.h>
 #include <linux/freezer.h>
+#include <linux/kref.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
 
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-common.h>
-#include <media/videobuf-dma-sg.h>
+#include <media/videobuf2-v4l2.h>
+#include <media/videobuf2-dma-sg.h>
 
 #include "solo6x10.h"
 #include "tw28.h"
 #include "solo6x10-jpeg.h"
+#include "compat.h"
 
 #define MIN_VID_BUFFERS		2
 #define FRAME_BUF_SIZE		(196 * 1024)
 #define MP4_QS			16
 #define DMA_ALIGN		4096
 
-enum solo_enc_types {
-	SOLO_ENC_TYPE_STD,
-	SOLO_ENC_TYPE_EXT,
+/* Enough P2M descriptors to move a whole frame in one chain: one per page,
+ * one more for an unaligned first page, one for the split at the end of
+ * the ring, plus the unused desc[0]. */
+#define SOLO_ENC_NR_DESC	(FRAME_BUF_SIZE / PAGE_SIZE + 4)
+
+/* Bitstream ring limits, frames are packed on this alignment */
+#define RING_MIN_DATA		(FRAME_BUF_SIZE * 2)
+#define RING_MAX_DATA		(64 * 1024 * 1024)
+#define RING_MAX_INDEX		65536
+#define RING_ALIGN		64
+
+static unsigned int gop_cache_kb = 1024;
+module_param(gop_cache_kb, uint, 0644);
+MODULE_PARM_DESC(gop_cache_kb,
+		 "Per stream cache of the current MPEG GOP, replayed to new "
+		 "readers (default: 1024 KiB, 0 to disable)");
+
+static unsigned int preroll_kb = 8192;
+module_param(preroll_kb, uint, 0644);
+MODULE_PARM_DESC(preroll_kb,
+		 "Per stream limit on what a pre-roll holds "
+		 "(default: 8192 KiB)");
+
+static bool gate_cache;
+module_param(gate_cache, bool, 0644);
+MODULE_PARM_DESC(gate_cache,
+		 "Fetch the frames the motion gate holds back into the GOP "
+		 "cache, so that the gate can open mid-GOP (default: off)");
+
+/* Most frames cached per stream, and queued up for a reader behind them */
+#define SOLO_ENC_CACHE_FRAMES	1024
+#define SOLO_ENC_REPLAY_FRAMES	(SOLO_ENC_CACHE_FRAMES * 2)
+
+/* Largest gap between one frame's end and the next frame in the MPEG
+ * ring that isn't taken to be frames whose queue entries were lost */
+#define MP4E_RING_SLACK		1024
+
+struct solo_enc_ring {
+	void			*mem;
+	unsigned long		mem_size;
+	struct solo_enc_ring_ctl *ctl;
+	struct solo_enc_ring_idx *idx;
+	u8			*data;
+	/* Our own copy of each entry's offset, userspace can write idx */
+	u32			*offs;
+	u32			data_size;
+	u32			nr_index;
+	u32			data_head;
+	u32			idx_head;
+	struct mutex		lock;
+	wait_queue_head_t	wait;
 };
 
+/* A handle on a channel's node, or on the all-channel node when enc is
+ * NULL, in which case chan_mask holds the channels it turned on. */
 struct solo_enc_fh {
 	struct			solo_enc_dev *enc;
+	struct solo_dev		*solo_dev;
+	u32			chan_mask;
 	u32			fmt;
 	u8			enc_on;
 	enum solo_enc_types	type;
-	struct videobuf_queue	vidq;
+	struct vb2_queue	vidq;
+	struct mutex		lock;
 	struct list_head	vidq_active;
-	int			desc_count;
-	int			desc_nelts;
-	struct solo_p2m_desc	*desc_items;
-	dma_addr_t		desc_dma;
+	/* Frames lost because nothing was queued to take them */
+	atomic_t		drops;
+	/* Cached frames not handed out yet, see solo_enc_replay_start() */
+	struct solo_enc_gop_frame **replay;
+	unsigned int		replay_head;
+	unsigned int		replay_nr;
+	/* Start from the whole pre-roll rather than the current GOP */
+	u8			preroll;
 	spinlock_t		av_lock;
 	struct list_head	list;
+	struct solo_enc_ring	*ring;
 };
 
-struct solo_videobuf {
-	struct videobuf_buffer	vb;
+struct solo_vb2_buf {
+	struct vb2_v4l2_buffer	vb;
+	struct list_head	list;
+};
+
+/* A frame pulled from SDRAM once, complete with its VOP or JPEG header,
+ * so that it can be copied out to every listener that wants it. */
+struct solo_enc_frame_buf {
+	void			*data;
+	dma_addr_t		dma;
+	unsigned int		size;
 	unsigned int		flags;
 };
 
+/* A copy of one frame of the current GOP, the data follows. Only fbuf's
+ * data, size and flags are used. Replays hold a reference while they
+ * copy out of it. */
+struct solo_enc_gop_frame {
+	struct kref		kref;
+	struct solo_enc_frame_buf fbuf;
+	struct solo_enc_buf	enc_buf;
+	struct list_head	list;
+};
+
 /* 6010 M4V */
 static unsigned char vop_6010_ntsc_d1[] = {
 	0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x20,
@@ -119,80 +201,6 @@ static unsigned char vop_6110_pal_cif[] = {
 	0x01, 0x68, 0xce, 0x32, 0x28, 0x00, 0x00, 0x00,
 };
 
-
-static const u32 solo_user_ctrls[] = {
-	V4L2_CID_BRIGHTNESS,
-	V4L2_CID_CONTRAST,
-	V4L2_CID_SATURATION,
-	V4L2_CID_HUE,
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 28)
-	V4L2_CID_SHARPNESS,
-#endif
-	0
-};
-
-static const u32 solo_mpeg_ctrls[] = {
-	V4L2_CID_MPEG_VIDEO_ENCODING,
-	V4L2_CID_MPEG_VIDEO_GOP_SIZE,
-	0
-};
-
-static const u32 solo_private_ctrls[] = {
-	V4L2_CID_MOTION_ENABLE,
-	V4L2_CID_MOTION_THRESHOLD,
-	0
-};
-
-static const u32 solo_fmtx_ctrls[] = {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
-	V4L2_CID_RDS_TX_RADIO_TEXT,
-#endif
-	0
-};
-
-static const u32 *solo_ctrl_classes[] = {
-	solo_user_ctrls,
-	solo_mpeg_ctrls,
-	solo_fmtx_ctrls,
-	solo_private_ctrls,
-	NULL
-};
-
-struct vop_header {
-	/* VE_STATUS0 */
-	u32 mpeg_size:20, sad_motion_flag:1, video_motion_flag:1, vop_type:2,
-		channel:5, source_fl:1, interlace:1, progressive:1;
-
-	/* VE_STATUS1 */
-	u32 vsize:8, hsize:8, last_queue:4, nop0:8, scale:4;
-
-	/* VE_STATUS2 */
-	u32 mpeg_off;
-
-	/* VE_STATUS3 */
-	u32 jpeg_off;
-
-	/* VE_STATUS4 */
-	u32 jpeg_size:20, interval:10, nop1:2;
-
-	/* VE_STATUS5/6 */
-	u32 sec, usec;
-
-	/* VE_STATUS7/8/9 */
-	u32 nop2[3];
-
-	/* VE_STATUS10 */
-	u32 mpeg_size_alt:20, nop3:12;
-
-	u32 end_nops[5];
-} __packed;
-
-struct solo_enc_buf {
-	enum solo_enc_types	type;
-	struct vop_header	*vh;
-	int			motion;
-};
-
 static int solo_is_motion_on(struct solo_enc_dev *solo_enc)
 {
 	struct solo_dev *solo_dev = solo_enc->solo_dev;
@@ -232,9 +240,11 @@ static void solo_motion_toggle(struct solo_enc_dev *solo_enc, int on)
 
 	solo_reg_write(solo_dev, SOLO_VI_MOT_CLEAR, mask);
 
-	solo_reg_write(solo_dev, SOLO_VI_MOT_ADR,
-		       SOLO_VI_MOTION_EN(solo_dev->motion_mask) |
-		       (SOLO_MOTION_EXT_ADDR(solo_dev) >> 16));
+	/* Only the enable bits change; the base address is set up by
+	 * solo_disp_init() */
+	solo_shadow_update(solo_dev, SOLO_SHADOW_VI_MOT_ADR,
+			   SOLO_VI_MOTION_EN(mask),
+			   on ? SOLO_VI_MOTION_EN(mask) : 0);
 
 	spin_unlock_irqrestore(&solo_enc->motion_lock, flags);
 }
@@ -247,7 +257,6 @@ static void solo_update_mode(struct solo_enc_dev *solo_enc)
 	unsigned char *vop;
 
 	solo_enc->interlaced = (solo_enc->mode & 0x08) ? 1 : 0;
-	solo_enc->bw_weight = max(solo_dev->fps / solo_enc->interval, 1);
 
 	if (solo_enc->mode == SOLO_ENC_MODE_CIF) {
 		solo_enc->width = solo_dev->video_hsize >> 1;
@@ -272,7 +281,6 @@ static void solo_update_mode(struct solo_enc_dev *solo_enc)
 	} else {
 		solo_enc->width = solo_dev->video_hsize;
 		solo_enc->height = solo_dev->video_vsize << 1;
-		solo_enc->bw_weight <<= 2;
 		if (solo_dev->type == SOLO_DEV_6110) {
 			if (solo_dev->video_type == SOLO_VO_FMT_TYPE_NTSC) {
 				vop = vop_6110_ntsc_d1;
@@ -294,10 +302,12 @@ static void solo_update_mode(struct solo_enc_dev *solo_enc)
 
 	memcpy(solo_enc->vop, vop, vop_len);
 
+	solo_enc->vop_interval = solo_enc->sched_interval;
+
 	/* Some fixups for 6010/M4V */
 	if (solo_dev->type == SOLO_DEV_6010) {
 		u16 fps = solo_dev->fps * 1000;
-		u16 interval = solo_enc->interval * 1000;
+		u16 interval = solo_enc->vop_interval * 1000;
 
 		vop = solo_enc->vop;
 
@@ -322,38 +332,241 @@ static void solo_update_mode(struct solo_enc_dev *solo_enc)
 	       jpeg_dqt[solo_g_jpeg_qp(solo_dev, solo_enc->ch)], DQT_LEN);
 }
 
+static void solo_enc_gop_frame_release(struct kref *kref)
+{
+	struct solo_enc_gop_frame *gf =
+		container_of(kref, struct solo_enc_gop_frame, kref);
+
+	kvfree(gf);
+}
+
+static void solo_enc_gop_frame_put(struct solo_enc_gop_frame *gf)
+{
+	kref_put(&gf->kref, solo_enc_gop_frame_release);
+}
+
+static void solo_enc_gop_unlink(struct solo_enc_gop *gop,
+				struct solo_enc_gop_frame *gf)
+{
+	list_del(&gf->list);
+	gop->nr--;
+	gop->bytes -= gf->fbuf.size;
+	if (gop->key == gf)
+		gop->key = NULL;
+	solo_enc_gop_frame_put(gf);
+}
+
+static void solo_enc_gop_clear(struct solo_enc_gop *gop)
+{
+	while (!list_empty(&gop->frames))
+		solo_enc_gop_unlink(gop, list_first_entry(&gop->frames,
+				    struct solo_enc_gop_frame, list));
+}
+
+/* Drop the oldest GOP */
+static void solo_enc_gop_trim(struct solo_enc_gop *gop)
+{
+	struct solo_enc_gop_frame *gf;
+
+	do {
+		gf = list_first_entry(&gop->frames, struct solo_enc_gop_frame,
+				      list);
+		solo_enc_gop_unlink(gop, gf);
+	} while (!list_empty(&gop->frames) &&
+		 list_first_entry(&gop->frames, struct solo_enc_gop_frame,
+				  list)->enc_buf.vh.vop_type);
+}
+
 /* MUST be called with solo_enc->enable_lock held */
-static int __solo_enc_on(struct solo_enc_fh *fh)
+static void solo_enc_replay_flush(struct solo_enc_fh *fh)
+{
+	while (fh->replay_nr) {
+		solo_enc_gop_frame_put(fh->replay[fh->replay_head]);
+		fh->replay_head = (fh->replay_head + 1) %
+			SOLO_ENC_REPLAY_FRAMES;
+		fh->replay_nr--;
+	}
+}
+
+/* What a channel takes out of the encoder budget at a given interval */
+static unsigned int solo_enc_weight(struct solo_enc_dev *solo_enc,
+				    u8 interval)
+{
+	unsigned int weight = max(solo_enc->solo_dev->fps / interval, 1);
+
+	return solo_enc->mode == SOLO_ENC_MODE_CIF ? weight : weight << 2;
+}
+
+static u8 solo_enc_max_interval(struct solo_enc_dev *solo_enc)
+{
+	return max(solo_enc->max_interval, solo_enc->interval);
+}
+
+static u8 solo_enc_hw_interval(struct solo_enc_dev *solo_enc)
+{
+	if (solo_enc->interlaced)
+		return solo_enc->sched_interval - 1;
+
+	return solo_enc->sched_interval;
+}
+
+/* Share the encoder budget out among the running channels, and join if
+ * it is about to start. Every channel starts out at the interval it was
+ * set to. While that is over budget, the channel of lowest priority that
+ * can still go slower is slowed by one frame; between equals, the one
+ * taking the most goes first. Running channels whose interval changed
+ * are reprogrammed at their next keyframe, see solo_enc_reconf(). Fails
+ * only if the budget can't be met even with every channel at its max
+ * interval. MUST be called with solo_dev->enc_sched_lock held */
+static int solo_enc_sched(struct solo_dev *solo_dev,
+			  struct solo_enc_dev *join)
+{
+	u8 ivl[SOLO_MAX_CHANNELS];
+	unsigned int total = 0;
+	int i;
+
+	BUG_ON(!mutex_is_locked(&solo_dev->enc_sched_lock));
+
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		struct solo_enc_dev *solo_enc = solo_dev->v4l2_enc[i];
+
+		ivl[i] = solo_enc->interval;
+		if (solo_enc->sched_on || solo_enc == join)
+			total += solo_enc_weight(solo_enc, ivl[i]);
+	}
+
+	while (total > solo_dev->enc_bw) {
+		struct solo_enc_dev *best = NULL;
+
+		for (i = 0; i < solo_dev->nr_chans; i++) {
+			struct solo_enc_dev *solo_enc = solo_dev->v4l2_enc[i];
+
+			if (!solo_enc->sched_on && solo_enc != join)
+				continue;
+			if (ivl[i] >= solo_enc_max_interval(solo_enc))
+				continue;
+
+			if (best == NULL ||
+			    solo_enc->priority < best->priority ||
+			    (solo_enc->priority == best->priority &&
+			     solo_enc_weight(solo_enc, ivl[i]) >
+			     solo_enc_weight(best, ivl[best->ch])))
+				best = solo_enc;
+		}
+
+		if (best == NULL)
+			return -EBUSY;
+
+		total -= solo_enc_weight(best, ivl[best->ch]);
+		ivl[best->ch]++;
+		total += solo_enc_weight(best, ivl[best->ch]);
+	}
+
+	if (join)
+		join->sched_on = 1;
+
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		struct solo_enc_dev *solo_enc = solo_dev->v4l2_enc[i];
+
+		if (ivl[i] == solo_enc->sched_interval)
+			continue;
+
+		WRITE_ONCE(solo_enc->sched_interval, ivl[i]);
+
+		/* The one joining is programmed by __solo_enc_start() */
+		if (solo_enc->sched_on && solo_enc != join)
+			WRITE_ONCE(solo_enc->reconf, 1);
+	}
+
+	return 0;
+}
+
+/* Program a running channel with the interval, GOP and QP it has now,
+ * and regenerate its VOP header to match. Only called at a keyframe,
+ * before that is fetched, so the GOP it starts is the first described
+ * by the new header; only the frames the encoder already had in hand
+ * are still taken at the old settings. MUST be called with
+ * solo_enc->enable_lock held */
+static void solo_enc_reconf(struct solo_enc_dev *solo_enc)
 {
-	struct solo_enc_dev *solo_enc = fh->enc;
-	u8 ch = solo_enc->ch;
 	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	u8 ch = solo_enc->ch;
+	unsigned long flags;
 	u8 interval;
 
 	BUG_ON(!mutex_is_locked(&solo_enc->enable_lock));
 
-	if (fh->enc_on)
-		return 0;
+	/* Keeps the scheduler off sched_interval until it is applied */
+	mutex_lock(&solo_dev->enc_sched_lock);
 
+	solo_enc->reconf = 0;
 	solo_update_mode(solo_enc);
+	interval = solo_enc_hw_interval(solo_enc);
+
+	solo_reg_batch_begin(solo_dev, &flags);
+
+	solo_reg_batch_write(solo_dev, SOLO_VE_CH_GOP(ch), solo_enc->gop);
+	solo_reg_batch_write(solo_dev, SOLO_VE_CH_QP(ch), solo_enc->qp);
+	solo_reg_batch_write(solo_dev, SOLO_CAP_CH_INTV(ch), interval);
+
+	solo_reg_batch_write(solo_dev, SOLO_VE_CH_GOP_E(ch), solo_enc->gop);
+	solo_reg_batch_write(solo_dev, SOLO_VE_CH_QP_E(ch), solo_enc->qp);
+	solo_reg_batch_write(solo_dev, SOLO_CAP_CH_INTV_E(ch), interval);
+
+	solo_reg_batch_commit(solo_dev, flags);
+
+	mutex_unlock(&solo_dev->enc_sched_lock);
+}
+
+/* Have a running channel take new settings at its next keyframe, an idle
+ * one gets them when started. MUST be called with solo_enc->enable_lock
+ * held */
+static void solo_enc_reconf_later(struct solo_enc_dev *solo_enc)
+{
+	BUG_ON(!mutex_is_locked(&solo_enc->enable_lock));
+
+	if (atomic_read(&solo_enc->readers) > 0)
+		WRITE_ONCE(solo_enc->reconf, 1);
+}
+
+/* Account for one more reader of the channel, and start the encoder if
+ * it is the first one of its kind. MUST be called with
+ * solo_enc->enable_lock held */
+static int __solo_enc_start(struct solo_enc_dev *solo_enc, u32 fmt,
+			    enum solo_enc_types type)
+{
+	u8 ch = solo_enc->ch;
+	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	unsigned long flags;
+	u8 interval;
+
+	BUG_ON(!mutex_is_locked(&solo_enc->enable_lock));
 
-	/* Make sure to bw check on first reader */
+	/* The first reader gets the channel its share of the encoder */
 	if (!atomic_read(&solo_enc->readers)) {
-		if (solo_enc->bw_weight > solo_dev->enc_bw_remain)
-			return -EBUSY;
-		else
-			solo_dev->enc_bw_remain -= solo_enc->bw_weight;
+		int ret;
+
+		mutex_lock(&solo_dev->enc_sched_lock);
+		ret = solo_enc_sched(solo_dev, solo_enc);
+		/* Everything is programmed below */
+		if (!ret)
+			solo_enc->reconf = 0;
+		mutex_unlock(&solo_dev->enc_sched_lock);
+		if (ret)
+			return ret;
 	}
 
-	fh->enc_on = 1;
-	list_add(&fh->list, &solo_enc->listeners);
+	/* A change that is still waiting for its keyframe brings the
+	 * header along with it */
+	if (!READ_ONCE(solo_enc->reconf))
+		solo_update_mode(solo_enc);
 
-	if (fh->type == SOLO_ENC_TYPE_EXT)
+	if (type == SOLO_ENC_TYPE_EXT)
 		solo_reg_write(solo_dev, SOLO_CAP_CH_COMP_ENA_E(ch), 1);
 
 	/* Reset the encoder if we are the first mpeg reader, else only reset
 	 * on the first mjpeg reader. */
-	if (fh->fmt == V4L2_PIX_FMT_MPEG) {
+	if (fmt == V4L2_PIX_FMT_MPEG) {
 		atomic_inc(&solo_enc->readers);
 		if (atomic_inc_return(&solo_enc->mpeg_readers) > 1)
 			return 0;
@@ -361,69 +574,93 @@ static int __solo_enc_on(struct solo_enc_fh *fh)
 		return 0;
 	}
 
+	interval = solo_enc_hw_interval(solo_enc);
+
+	solo_reg_batch_begin(solo_dev, &flags);
+
 	/* Disable all encoding for this channel */
-	solo_reg_write(solo_dev, SOLO_CAP_CH_SCALE(ch), 0);
+	solo_reg_batch_write(solo_dev, SOLO_CAP_CH_SCALE(ch), 0);
 
 	/* Common for both std and ext encoding */
-	solo_reg_write(solo_dev, SOLO_VE_CH_INTL(ch),
-		       solo_enc->interlaced ? 1 : 0);
-
-	if (solo_enc->interlaced)
-		interval = solo_enc->interval - 1;
-	else
-		interval = solo_enc->interval;
+	solo_reg_batch_write(solo_dev, SOLO_VE_CH_INTL(ch),
+			     solo_enc->interlaced ? 1 : 0);
 
 	/* Standard encoding only */
-	solo_reg_write(solo_dev, SOLO_VE_CH_GOP(ch), solo_enc->gop);
-	solo_reg_write(solo_dev, SOLO_VE_CH_QP(ch), solo_enc->qp);
-	solo_reg_write(solo_dev, SOLO_CAP_CH_INTV(ch), interval);
+	solo_reg_batch_write(solo_dev, SOLO_VE_CH_GOP(ch), solo_enc->gop);
+	solo_reg_batch_write(solo_dev, SOLO_VE_CH_QP(ch), solo_enc->qp);
+	solo_reg_batch_write(solo_dev, SOLO_CAP_CH_INTV(ch), interval);
 
 	/* Extended encoding only */
-	solo_reg_write(solo_dev, SOLO_VE_CH_GOP_E(ch), solo_enc->gop);
-	solo_reg_write(solo_dev, SOLO_VE_CH_QP_E(ch), solo_enc->qp);
-	solo_reg_write(solo_dev, SOLO_CAP_CH_INTV_E(ch), interval);
+	solo_reg_batch_write(solo_dev, SOLO_VE_CH_GOP_E(ch), solo_enc->gop);
+	solo_reg_batch_write(solo_dev, SOLO_VE_CH_QP_E(ch), solo_enc->qp);
+	solo_reg_batch_write(solo_dev, SOLO_CAP_CH_INTV_E(ch), interval);
 
 	/* Enables the standard encoder */
-	solo_reg_write(solo_dev, SOLO_CAP_CH_SCALE(ch), solo_enc->mode);
+	solo_reg_batch_write(solo_dev, SOLO_CAP_CH_SCALE(ch), solo_enc->mode);
+
+	solo_reg_batch_commit(solo_dev, flags);
 
 	return 0;
 }
 
-static int solo_enc_on(struct solo_enc_fh *fh)
+/* MUST be called with solo_enc->enable_lock held */
+static void __solo_enc_stop(struct solo_enc_dev *solo_enc, u32 fmt)
+{
+	struct solo_dev *solo_dev = solo_enc->solo_dev;
+
+	BUG_ON(!mutex_is_locked(&solo_enc->enable_lock));
+
+	/* Nothing keeps the GOP cache current once MPEG is off */
+	if (fmt == V4L2_PIX_FMT_MPEG &&
+	    atomic_dec_return(&solo_enc->mpeg_readers) == 0) {
+		solo_enc_gop_clear(&solo_enc->gop[SOLO_ENC_TYPE_STD]);
+		solo_enc_gop_clear(&solo_enc->gop[SOLO_ENC_TYPE_EXT]);
+	}
+
+	if (atomic_dec_return(&solo_enc->readers) > 0)
+		return;
+
+	/* Whoever is left may speed up again */
+	mutex_lock(&solo_dev->enc_sched_lock);
+	solo_enc->sched_on = 0;
+	solo_enc_sched(solo_dev, NULL);
+	mutex_unlock(&solo_dev->enc_sched_lock);
+
+	solo_reg_write(solo_dev, SOLO_CAP_CH_SCALE(solo_enc->ch), 0);
+	solo_reg_write(solo_dev, SOLO_CAP_CH_COMP_ENA_E(solo_enc->ch), 0);
+}
+
+/* MUST be called with solo_enc->enable_lock held */
+static int __solo_enc_on(struct solo_enc_fh *fh)
 {
 	struct solo_enc_dev *solo_enc = fh->enc;
 	int ret;
 
-	mutex_lock(&solo_enc->enable_lock);
-	ret = __solo_enc_on(fh);
-	mutex_unlock(&solo_enc->enable_lock);
+	if (fh->enc_on)
+		return 0;
 
-	return ret;
+	ret = __solo_enc_start(solo_enc, fh->fmt, fh->type);
+	if (ret)
+		return ret;
+
+	fh->enc_on = 1;
+	list_add(&fh->list, &solo_enc->listeners);
+
+	return 0;
 }
 
 static void __solo_enc_off(struct solo_enc_fh *fh)
 {
-	struct solo_enc_dev *solo_enc = fh->enc;
-	struct solo_dev *solo_dev = solo_enc->solo_dev;
-
-	BUG_ON(!mutex_is_locked(&solo_enc->enable_lock));
+	BUG_ON(!mutex_is_locked(&fh->enc->enable_lock));
 
 	if (!fh->enc_on)
 		return;
 
 	list_del(&fh->list);
 	fh->enc_on = 0;
+	solo_enc_replay_flush(fh);
 
-	if (fh->fmt == V4L2_PIX_FMT_MPEG)
-		atomic_dec(&solo_enc->mpeg_readers);
-
-	if (atomic_dec_return(&solo_enc->readers) > 0)
-		return;
-
-	solo_dev->enc_bw_remain += solo_enc->bw_weight;
-
-	solo_reg_write(solo_dev, SOLO_CAP_CH_SCALE(solo_enc->ch), 0);
-	solo_reg_write(solo_dev, SOLO_CAP_CH_COMP_ENA_E(solo_enc->ch), 0);
+	__solo_enc_stop(fh->enc, fh->fmt);
 }
 
 static void solo_enc_off(struct solo_enc_fh *fh)
@@ -435,59 +672,93 @@ static void solo_enc_off(struct solo_enc_fh *fh)
 	mutex_unlock(&solo_enc->enable_lock);
 }
 
-static int enc_get_mpeg_dma(struct solo_dev *solo_dev, dma_addr_t dma,
-			      unsigned int off, unsigned int size)
+/* Turn on every channel the encoder bandwidth still has room for. Only
+ * fails if there was room for none of them. */
+static int solo_enc_mux_on(struct solo_enc_fh *fh)
 {
-	int ret;
+	struct solo_dev *solo_dev = fh->solo_dev;
+	int i;
 
-	if (off > SOLO_MP4E_EXT_SIZE(solo_dev))
-		return -EINVAL;
+	mutex_lock(&solo_dev->enc_mux_lock);
 
-	/* Single shot */
-	if (off + size <= SOLO_MP4E_EXT_SIZE(solo_dev)) {
-		return solo_p2m_dma_t(solo_dev, 0, dma,
-				      SOLO_MP4E_EXT_ADDR(solo_dev) + off, size,
-				      0, 0);
+	if (fh->enc_on) {
+		mutex_unlock(&solo_dev->enc_mux_lock);
+		return 0;
 	}
 
-	/* Buffer wrap */
-	ret = solo_p2m_dma_t(solo_dev, 0, dma,
-			     SOLO_MP4E_EXT_ADDR(solo_dev) + off,
-			     SOLO_MP4E_EXT_SIZE(solo_dev) - off, 0, 0);
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		struct solo_enc_dev *solo_enc = solo_dev->v4l2_enc[i];
+
+		mutex_lock(&solo_enc->enable_lock);
+		if (!__solo_enc_start(solo_enc, fh->fmt, fh->type))
+			fh->chan_mask |= 1 << i;
+		mutex_unlock(&solo_enc->enable_lock);
+	}
 
-	if (!ret) {
-		ret = solo_p2m_dma_t(solo_dev, 0,
-			     dma + SOLO_MP4E_EXT_SIZE(solo_dev) - off,
-			     SOLO_MP4E_EXT_ADDR(solo_dev),
-			     size + off - SOLO_MP4E_EXT_SIZE(solo_dev), 0, 0);
+	if (!fh->chan_mask) {
+		mutex_unlock(&solo_dev->enc_mux_lock);
+		return -EBUSY;
 	}
 
-	return ret;
+	fh->enc_on = 1;
+	list_add(&fh->list, &solo_dev->enc_mux_listeners);
+
+	mutex_unlock(&solo_dev->enc_mux_lock);
+
+	return 0;
+}
+
+static void solo_enc_mux_off(struct solo_enc_fh *fh)
+{
+	struct solo_dev *solo_dev = fh->solo_dev;
+	int i;
+
+	mutex_lock(&solo_dev->enc_mux_lock);
+
+	if (!fh->enc_on) {
+		mutex_unlock(&solo_dev->enc_mux_lock);
+		return;
+	}
+
+	list_del(&fh->list);
+	fh->enc_on = 0;
+
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		struct solo_enc_dev *solo_enc = solo_dev->v4l2_enc[i];
+
+		if (!(fh->chan_mask & (1 << i)))
+			continue;
+
+		mutex_lock(&solo_enc->enable_lock);
+		__solo_enc_stop(solo_enc, fh->fmt);
+		mutex_unlock(&solo_enc->enable_lock);
+	}
+	fh->chan_mask = 0;
+
+	mutex_unlock(&solo_dev->enc_mux_lock);
 }
 
 /* Build a descriptor queue out of an SG list and send it to the P2M for
- * processing. */
-static int solo_send_desc(struct solo_enc_fh *fh, int skip,
-			  struct videobuf_dmabuf *vbuf, int off, int size,
+ * processing. Only the channel's worker gets here, so it has the
+ * channel's slice of the descriptor pool to itself. */
+static int solo_send_desc(struct solo_enc_dev *solo_enc, int caller,
+			  int skip, struct sg_table *sgt, int off, int size,
 			  unsigned int base, unsigned int base_size)
 {
-	struct solo_dev *solo_dev = fh->enc->solo_dev;
+	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	struct solo_p2m_desc *desc = solo_enc->desc;
 	struct scatterlist *sg;
+	int desc_cnt = 1;
 	int i;
 	int ret;
 
 	if (WARN_ON_ONCE(size > FRAME_BUF_SIZE))
 		return -EINVAL;
 
-	fh->desc_count = 1;
-
-	for_each_sg(vbuf->sglist, sg, vbuf->sglen, i) {
-		struct solo_p2m_desc *desc;
+	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
 		dma_addr_t dma;
 		int len;
-		int left = base_size - off;
 
-		desc = &fh->desc_items[fh->desc_count++];
 		dma = sg_dma_address(sg);
 		len = sg_dma_len(sg);
 
@@ -502,28 +773,16 @@ static int solo_send_desc(struct solo_enc_fh *fh, int skip,
 
 		len = min(len, size);
 
-		if (len <= left) {
-			/* Single descriptor */
-			solo_p2m_fill_desc(desc, 0, dma, base + off,
-					   len, 0, 0);
+		if (off + len <= base_size) {
+			solo_p2m_fill_desc(&desc[desc_cnt++], 0, dma,
+					   base + off, len, 0, 0);
 		} else {
-			/* Buffer wrap */
-			/* XXX: Do these as separate DMA requests, to avoid
-			   timeout errors triggered by awkwardly sized
-			   descriptors. See
-			   <https://github.com/bluecherrydvr/solo6x10/issues/8>
-			 */
-			ret = solo_p2m_dma_t(solo_dev, 0, dma, base + off,
-					     left, 0, 0);
-			if (ret)
-				return ret;
-
-			ret = solo_p2m_dma_t(solo_dev, 0, dma + left, base,
-					     len - left, 0, 0);
+			/* A segment crossing the end of the ring goes on its
+			 * own, see solo_p2m_dma_ring() */
+			ret = solo_p2m_dma_ring(solo_dev, caller, 0, dma, base,
+						base_size, off, len);
 			if (ret)
 				return ret;
-
-			fh->desc_count--;
 		}
 
 		size -= len;
@@ -534,182 +793,1064 @@ static int solo_send_desc(struct solo_enc_fh *fh, int skip,
 		if (off >= base_size)
 			off -= base_size;
 
-		/* Because we may use two descriptors per loop */
-		if (fh->desc_count >= (fh->desc_nelts - 1)) {
-			ret = solo_p2m_dma_desc(solo_dev, fh->desc_items,
-						fh->desc_dma,
-						fh->desc_count - 1);
+		/* The pool is sized so that this only happens on an SG list
+		 * made of sub-page segments. */
+		if (desc_cnt >= SOLO_ENC_NR_DESC) {
+			ret = solo_p2m_dma_desc(solo_dev, caller, desc,
+						desc_cnt - 1);
 			if (ret)
 				return ret;
-			fh->desc_count = 1;
+			desc_cnt = 1;
 		}
 	}
 
-	if (fh->desc_count <= 1)
+	if (desc_cnt <= 1)
 		return 0;
 
-	return solo_p2m_dma_desc(solo_dev, fh->desc_items, fh->desc_dma,
-				 fh->desc_count - 1);
+	return solo_p2m_dma_desc(solo_dev, caller, desc, desc_cnt - 1);
 }
 
-static int solo_fill_jpeg(struct solo_enc_fh *fh, struct videobuf_buffer *vb,
-			  struct videobuf_dmabuf *vbuf, struct vop_header *vh)
+static int solo_fill_jpeg(struct solo_enc_fh *fh, struct vb2_buffer *vb,
+			  struct sg_table *sgt, struct vop_header *vh)
 {
 	struct solo_enc_dev *solo_enc = fh->enc;
 	struct solo_dev *solo_dev = solo_enc->solo_dev;
-	struct solo_videobuf *svb = (struct solo_videobuf *)vb;
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
 	int frame_size;
 
-	svb->flags |= V4L2_BUF_FLAG_KEYFRAME;
+	vbuf->flags |= V4L2_BUF_FLAG_KEYFRAME;
 
-	if (vb->bsize < (vh->jpeg_size + solo_enc->jpeg_len))
+	if (vb2_plane_size(vb, 0) < vh->jpeg_size + solo_enc->jpeg_len)
 		return -EIO;
 
-	vb->width = solo_enc->width;
-	vb->height = solo_enc->height;
-	vb->size = vh->jpeg_size + solo_enc->jpeg_len;
+	vb2_set_plane_payload(vb, 0, vh->jpeg_size + solo_enc->jpeg_len);
 
-	sg_copy_from_buffer(vbuf->sglist, vbuf->sglen,
+	sg_copy_from_buffer(sgt->sgl, sgt->orig_nents,
 			    solo_enc->jpeg_header,
 			    solo_enc->jpeg_len);
 
 	frame_size = (vh->jpeg_size + solo_enc->jpeg_len + (DMA_ALIGN - 1))
 		& ~(DMA_ALIGN - 1);
 
-	return solo_send_desc(fh, solo_enc->jpeg_len, vbuf, vh->jpeg_off,
-			      frame_size, SOLO_JPEG_EXT_ADDR(solo_dev),
+	return solo_send_desc(solo_enc, SOLO_P2M_CALLER_JPEG, solo_enc->jpeg_len,
+			      sgt, vh->jpeg_off, frame_size,
+			      SOLO_JPEG_EXT_ADDR(solo_dev),
 			      SOLO_JPEG_EXT_SIZE(solo_dev));
 }
 
-static int solo_fill_mpeg(struct solo_enc_fh *fh, struct videobuf_buffer *vb,
-			  struct videobuf_dmabuf *vbuf, struct vop_header *vh)
+static int solo_fill_mpeg(struct solo_enc_fh *fh, struct vb2_buffer *vb,
+			  struct sg_table *sgt, struct vop_header *vh)
 {
 	struct solo_enc_dev *solo_enc = fh->enc;
 	struct solo_dev *solo_dev = solo_enc->solo_dev;
-	struct solo_videobuf *svb = (struct solo_videobuf *)vb;
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
 	int frame_off, frame_size;
 	int skip = 0;
 
-	if (vb->bsize < vh->mpeg_size)
+	if (vb2_plane_size(vb, 0) < vh->mpeg_size)
 		return -EIO;
 
-	vb->width = vh->hsize << 4;
-	vb->height = vh->vsize << 4;
-	vb->size = vh->mpeg_size;
-
 	/* If this is a key frame, add extra header */
 	if (!vh->vop_type) {
-		sg_copy_from_buffer(vbuf->sglist, vbuf->sglen,
+		sg_copy_from_buffer(sgt->sgl, sgt->orig_nents,
 				    solo_enc->vop,
 				    solo_enc->vop_len);
 
 		skip = solo_enc->vop_len;
-		vb->size += solo_enc->vop_len;
 
-		svb->flags |= V4L2_BUF_FLAG_KEYFRAME;
+		vbuf->flags |= V4L2_BUF_FLAG_KEYFRAME;
 	} else {
-		svb->flags |= V4L2_BUF_FLAG_PFRAME;
+		vbuf->flags |= V4L2_BUF_FLAG_PFRAME;
 	}
 
+	if (vb2_plane_size(vb, 0) < vh->mpeg_size + skip)
+		return -EIO;
+
+	vb2_set_plane_payload(vb, 0, vh->mpeg_size + skip);
+
 	/* Now get the actual mpeg payload */
 	frame_off = (vh->mpeg_off + sizeof(*vh))
 		% SOLO_MP4E_EXT_SIZE(solo_dev);
 	frame_size = (vh->mpeg_size + skip + (DMA_ALIGN - 1))
 		& ~(DMA_ALIGN - 1);
 
-	return solo_send_desc(fh, skip, vbuf, frame_off, frame_size,
+	return solo_send_desc(solo_enc, SOLO_P2M_CALLER_MPEG, skip, sgt,
+			      frame_off, frame_size,
 			      SOLO_MP4E_EXT_ADDR(solo_dev),
 			      SOLO_MP4E_EXT_SIZE(solo_dev));
 }
 
-static int solo_enc_fillbuf(struct solo_enc_fh *fh,
-			    struct videobuf_buffer *vb,
-			    struct solo_enc_buf *enc_buf)
+static void solo_enc_fanout_free(struct solo_enc_dev *solo_enc)
 {
-	struct solo_enc_dev *solo_enc = fh->enc;
-	struct solo_videobuf *svb = (struct solo_videobuf *)vb;
-	struct videobuf_dmabuf *vbuf = NULL;
-	struct vop_header *vh = enc_buf->vh;
-	int ret;
+	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	int i;
 
-	vbuf = videobuf_to_dma(vb);
-	if (WARN_ON_ONCE(!vbuf)) {
-		ret = -EIO;
-		goto vbuf_error;
-	}
+	for (i = 0; i < ARRAY_SIZE(solo_enc->fanout); i++) {
+		struct solo_enc_frame_buf *fbuf = solo_enc->fanout[i];
 
-	/* Setup some common flags for both types */
-	svb->flags = V4L2_BUF_FLAG_TIMECODE;
-	vb->ts.tv_sec = vh->sec;
-	vb->ts.tv_usec = vh->usec;
+		if (fbuf == NULL)
+			continue;
 
-	/* Check for motion flags */
-	if (solo_is_motion_on(solo_enc)) {
-		svb->flags |= V4L2_BUF_FLAG_MOTION_ON;
-		if (enc_buf->motion)
-			svb->flags |= V4L2_BUF_FLAG_MOTION_DETECTED;
+		if (fbuf->data)
+			pci_free_consistent(solo_dev->pdev, FRAME_BUF_SIZE,
+					    fbuf->data, fbuf->dma);
+		kfree(fbuf);
+		solo_enc->fanout[i] = NULL;
 	}
+}
 
-	if (fh->fmt == V4L2_PIX_FMT_MPEG)
-		ret = solo_fill_mpeg(fh, vb, vbuf, vh);
-	else
-		ret = solo_fill_jpeg(fh, vb, vbuf, vh);
+/* Each channel gets one MPEG and one JPEG fanout buffer up front, so the
+ * frame path never has to allocate coherent memory. A buffer is only
+ * ever used by the channel worker, and is done with by the time the next
+ * frame is fetched into it. */
+static int solo_enc_fanout_alloc(struct solo_enc_dev *solo_enc)
+{
+	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	int i;
 
-vbuf_error:
-	/* On error, we push this buffer back into the queue. The
-	 * videobuf-core doesn't handle error packets very well. Plus
-	 * we recover nicely internally anyway. */
-	if (ret) {
-		unsigned long flags;
+	for (i = 0; i < ARRAY_SIZE(solo_enc->fanout); i++) {
+		struct solo_enc_frame_buf *fbuf;
 
-		spin_lock_irqsave(&fh->av_lock, flags);
-		list_add(&vb->queue, &fh->vidq_active);
-		vb->state = VIDEOBUF_QUEUED;
-		spin_unlock_irqrestore(&fh->av_lock, flags);
-	} else {
-		vb->state = VIDEOBUF_DONE;
-		vb->field_count++;
-		vb->width = solo_enc->width;
-		vb->height = solo_enc->height;
+		fbuf = kzalloc(sizeof(*fbuf), GFP_KERNEL);
+		if (fbuf == NULL)
+			goto fail;
+		solo_enc->fanout[i] = fbuf;
 
-		wake_up(&vb->done);
+		fbuf->data = pci_alloc_consistent(solo_dev->pdev,
+						  FRAME_BUF_SIZE, &fbuf->dma);
+		if (fbuf->data == NULL)
+			goto fail;
 	}
 
-	return ret;
+	return 0;
+
+fail:
+	solo_enc_fanout_free(solo_enc);
+	return -ENOMEM;
 }
 
-static void solo_enc_handle_one(struct solo_enc_dev *solo_enc,
-				struct solo_enc_buf *enc_buf)
+/* Pull a whole frame, header included, into a fanout buffer with a single
+ * transfer. */
+static int solo_enc_fetch_frame(struct solo_enc_dev *solo_enc,
+				struct solo_enc_frame_buf *fbuf, int jpeg,
+				struct vop_header *vh)
 {
-	struct solo_enc_fh *fh;
-
-	mutex_lock(&solo_enc->enable_lock);
+	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	unsigned int base, base_size, off, skip;
+	int caller;
+
+	if (jpeg) {
+		memcpy(fbuf->data, solo_enc->jpeg_header, solo_enc->jpeg_len);
+		skip = solo_enc->jpeg_len;
+		fbuf->size = vh->jpeg_size + skip;
+		fbuf->flags = V4L2_BUF_FLAG_KEYFRAME;
+		off = vh->jpeg_off;
+		base = SOLO_JPEG_EXT_ADDR(solo_dev);
+		base_size = SOLO_JPEG_EXT_SIZE(solo_dev);
+		caller = SOLO_P2M_CALLER_JPEG;
+	} else {
+		skip = 0;
+		fbuf->flags = V4L2_BUF_FLAG_PFRAME;
+		if (!vh->vop_type) {
+			memcpy(fbuf->data, solo_enc->vop, solo_enc->vop_len);
+			skip = solo_enc->vop_len;
+			fbuf->flags = V4L2_BUF_FLAG_KEYFRAME;
+		}
+		fbuf->size = vh->mpeg_size + skip;
+		off = (vh->mpeg_off + sizeof(*vh)) %
+			SOLO_MP4E_EXT_SIZE(solo_dev);
+		base = SOLO_MP4E_EXT_ADDR(solo_dev);
+		base_size = SOLO_MP4E_EXT_SIZE(solo_dev);
+		caller = SOLO_P2M_CALLER_MPEG;
+	}
 
-	list_for_each_entry(fh, &solo_enc->listeners, list) {
-		struct videobuf_buffer *vb;
-		unsigned long flags;
+	if (ALIGN(fbuf->size, DMA_ALIGN) > FRAME_BUF_SIZE)
+		return -EIO;
 
-		if (fh->type != enc_buf->type)
-			continue;
+	return solo_p2m_dma_ring(solo_dev, caller, 0, fbuf->dma + skip, base,
+				 base_size, off,
+				 ALIGN(fbuf->size, DMA_ALIGN) - skip);
+}
 
+static int solo_fill_shared(struct vb2_buffer *vb, struct sg_table *sgt,
+			    struct solo_enc_frame_buf *fbuf)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
 
-		if (list_empty(&fh->vidq_active))
-			continue;
+	if (vb2_plane_size(vb, 0) < fbuf->size)
+		return -EIO;
 
-		spin_lock_irqsave(&fh->av_lock, flags);
+	vb2_set_plane_payload(vb, 0, fbuf->size);
+	vbuf->flags |= fbuf->flags;
 
-		vb = list_first_entry(&fh->vidq_active,
-				      struct videobuf_buffer, queue);
+	if (sg_copy_from_buffer(sgt->sgl, sgt->orig_nents, fbuf->data,
+				fbuf->size) != fbuf->size)
+		return -EIO;
 
-		list_del(&vb->queue);
-		vb->state = VIDEOBUF_ACTIVE;
+	return 0;
+}
 
-		spin_unlock_irqrestore(&fh->av_lock, flags);
+/* With fbuf set, the frame has already been fetched and is only copied
+ * into this listener's buffer. The buffer is not handed back yet. */
+static int __solo_enc_fillbuf(struct solo_enc_fh *fh,
+			    struct solo_enc_dev *solo_enc,
+			    struct vb2_buffer *vb,
+			    struct solo_enc_buf *enc_buf,
+			    struct solo_enc_frame_buf *fbuf)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct sg_table *sgt = vb2_dma_sg_plane_desc(vb, 0);
+	struct vop_header *vh = &enc_buf->vh;
+	int ret;
+
+	/* Setup some common flags for both types */
+	vbuf->flags &= ~(V4L2_BUF_FLAG_KEYFRAME | V4L2_BUF_FLAG_PFRAME |
+			 V4L2_BUF_FLAG_MOTION_ON |
+			 V4L2_BUF_FLAG_MOTION_DETECTED);
+	vbuf->flags |= V4L2_BUF_FLAG_TIMECODE;
+	vb->timestamp = (u64)vh->sec * NSEC_PER_SEC +
+			(u64)vh->usec * NSEC_PER_USEC;
+
+	/* Frames off the all-channel node say where they came from */
+	memset(&vbuf->timecode, 0, sizeof(vbuf->timecode));
+	if (fh->enc == NULL) {
+		vbuf->timecode.flags = V4L2_TC_USERBITS_USERDEFINED;
+		vbuf->timecode.userbits[SOLO_ENC_MUX_UB_CH] = solo_enc->ch;
+		vbuf->timecode.userbits[SOLO_ENC_MUX_UB_TYPE] = enc_buf->type;
+	}
+
+	/* Check for motion flags */
+	if (solo_is_motion_on(solo_enc)) {
+		vbuf->flags |= V4L2_BUF_FLAG_MOTION_ON;
+		if (enc_buf->motion)
+			vbuf->flags |= V4L2_BUF_FLAG_MOTION_DETECTED;
+	}
+
+	if (fbuf)
+		ret = solo_fill_shared(vb, sgt, fbuf);
+	else if (fh->fmt == V4L2_PIX_FMT_MPEG)
+		ret = solo_fill_mpeg(fh, vb, sgt, vh);
+	else
+		ret = solo_fill_jpeg(fh, vb, sgt, vh);
+
+	vbuf->field = solo_enc->interlaced ? V4L2_FIELD_INTERLACED :
+		      V4L2_FIELD_NONE;
+	vbuf->sequence = enc_buf->seq;
+
+	return ret;
+}
+
+static void solo_enc_buf_done(struct vb2_buffer *vb, int ret)
+{
+	/* A frame we failed to pull out of SDRAM is handed back flagged
+	 * as an error, the next one recovers on its own. */
+	vb2_buffer_done(vb, ret ? VB2_BUF_STATE_ERROR : VB2_BUF_STATE_DONE);
+}
+
+static int solo_enc_fillbuf(struct solo_enc_fh *fh,
+			    struct solo_enc_dev *solo_enc,
+			    struct vb2_buffer *vb,
+			    struct solo_enc_buf *enc_buf,
+			    struct solo_enc_frame_buf *fbuf)
+{
+	int ret = __solo_enc_fillbuf(fh, solo_enc, vb, enc_buf, fbuf);
+
+	solo_enc_buf_done(vb, ret);
+
+	return ret;
+}
+
+/* Append a frame to a handle's bitstream ring. Frames are never split
+ * across the end of the data area; when one doesn't fit there it goes
+ * back to the start, and if it doesn't fit before the oldest frame
+ * userspace still holds, it is dropped. */
+static void solo_enc_ring_put(struct solo_enc_fh *fh,
+			      struct solo_enc_dev *solo_enc,
+			      struct solo_enc_buf *enc_buf,
+			      struct solo_enc_frame_buf *fbuf)
+{
+	struct solo_enc_ring *ring = fh->ring;
+	struct solo_enc_ring_idx *e;
+	u32 size = ALIGN(fbuf->size, RING_ALIGN);
+	u32 tail, next, start, off;
+
+	mutex_lock(&ring->lock);
+
+	tail = READ_ONCE(ring->ctl->idx_tail) % ring->nr_index;
+	next = (ring->idx_head + 1) % ring->nr_index;
+	if (next == tail)
+		goto drop;
+
+	if (tail == ring->idx_head) {
+		/* Everything has been consumed */
+		ring->data_head = 0;
+		off = 0;
+		if (size > ring->data_size)
+			goto drop;
+	} else {
+		start = ring->offs[tail];
+		if (ring->data_head >= start) {
+			if (size <= ring->data_size - ring->data_head)
+				off = ring->data_head;
+			else if (size < start)
+				off = 0;
+			else
+				goto drop;
+		} else if (size < start - ring->data_head) {
+			off = ring->data_head;
+		} else {
+			goto drop;
+		}
+	}
+
+	memcpy(ring->data + off, fbuf->data, fbuf->size);
+
+	e = &ring->idx[ring->idx_head];
+	e->offset = off;
+	e->size = fbuf->size;
+	e->flags = fbuf->flags;
+	if (solo_is_motion_on(solo_enc)) {
+		e->flags |= V4L2_BUF_FLAG_MOTION_ON;
+		if (enc_buf->motion)
+			e->flags |= V4L2_BUF_FLAG_MOTION_DETECTED;
+	}
+	e->channel = solo_enc->ch;
+	e->type = enc_buf->type;
+	e->timestamp = (u64)enc_buf->vh.sec * NSEC_PER_SEC +
+		       (u64)enc_buf->vh.usec * NSEC_PER_USEC;
+	e->sequence = enc_buf->seq;
+
+	ring->offs[ring->idx_head] = off;
+	ring->data_head = off + size;
+	ring->idx_head = next;
+
+	/* The entry must be visible before the new head */
+	smp_wmb();
+	ring->ctl->idx_head = next;
+	ring->ctl->sequence++;
+
+	mutex_unlock(&ring->lock);
+
+	wake_up_interruptible(&ring->wait);
+
+	return;
+
+drop:
+	ring->ctl->dropped++;
+	mutex_unlock(&ring->lock);
+
+	atomic_inc(&fh->drops);
+	atomic_inc(&solo_enc->drops[SOLO_ENC_DROP_NOBUF]);
+}
+
+/* Fetch the frame into the channel's shared buffer for this format,
+ * unless that has already been tried for this frame. */
+static struct solo_enc_frame_buf *solo_enc_shared_frame(
+		struct solo_enc_dev *solo_enc, struct solo_enc_buf *enc_buf,
+		int jpeg, struct solo_enc_frame_buf **fbuf, int *fetched)
+{
+	if (fetched[jpeg])
+		return fbuf[jpeg];
+
+	fetched[jpeg] = 1;
+	fbuf[jpeg] = solo_enc->fanout[jpeg];
+	if (solo_enc_fetch_frame(solo_enc, fbuf[jpeg], jpeg, &enc_buf->vh))
+		fbuf[jpeg] = NULL;
+
+	return fbuf[jpeg];
+}
+
+static struct solo_vb2_buf *solo_enc_next_buf(struct solo_enc_fh *fh)
+{
+	struct solo_vb2_buf *svb = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fh->av_lock, flags);
+	if (!list_empty(&fh->vidq_active)) {
+		svb = list_first_entry(&fh->vidq_active,
+				       struct solo_vb2_buf, list);
+		list_del(&svb->list);
+	}
+	spin_unlock_irqrestore(&fh->av_lock, flags);
+
+	return svb;
+}
+
+/* What a stream's cache may hold, 0 when it is off */
+static size_t solo_enc_gop_limit(struct solo_enc_dev *solo_enc, int type)
+{
+	return (size_t)(solo_enc->preroll[type] ? preroll_kb :
+			gop_cache_kb) * 1024;
+}
+
+static u64 solo_enc_gop_usec(struct solo_enc_gop_frame *gf)
+{
+	return (u64)gf->enc_buf.vh.sec * USEC_PER_SEC + gf->enc_buf.vh.usec;
+}
+
+/* Drop old GOPs for as long as the one after still starts at least the
+ * pre-roll's worth of seconds before now. */
+static void solo_enc_gop_expire(struct solo_enc_gop *gop, unsigned int secs,
+				u64 now)
+{
+	struct solo_enc_gop_frame *gf;
+
+	for (;;) {
+		gf = list_first_entry(&gop->frames, struct solo_enc_gop_frame,
+				      list);
+		list_for_each_entry_continue(gf, &gop->frames, list) {
+			if (!gf->enc_buf.vh.vop_type)
+				break;
+		}
+
+		if (&gf->list == &gop->frames ||
+		    solo_enc_gop_usec(gf) + (u64)secs * USEC_PER_SEC > now)
+			break;
+
+		solo_enc_gop_trim(gop);
+	}
+}
+
+/* Make room for a copy of an MPEG frame if it carries on the GOP being
+ * cached. Without a pre-roll that is the only GOP kept. When over the
+ * limits, the oldest GOPs go first; a GOP in progress that has lost a
+ * frame or doesn't fit on its own is thrown away whole, since a decoder
+ * can't start from what would be left of it. The caller copies the frame
+ * in. MUST be called with solo_enc->enable_lock held */
+static struct solo_enc_gop_frame *solo_enc_gop_add(
+		struct solo_enc_dev *solo_enc, struct solo_enc_buf *enc_buf,
+		size_t size, u32 flags)
+{
+	struct solo_enc_gop *gop = &solo_enc->gop[enc_buf->type];
+	unsigned int secs = solo_enc->preroll[enc_buf->type];
+	size_t limit = solo_enc_gop_limit(solo_enc, enc_buf->type);
+	int key = !enc_buf->vh.vop_type;
+	struct solo_enc_gop_frame *gf;
+
+	if (key) {
+		if (!secs)
+			solo_enc_gop_clear(gop);
+	} else if (gop->key == NULL) {
+		return NULL;
+	} else if (list_last_entry(&gop->frames, struct solo_enc_gop_frame,
+				   list)->enc_buf.seq + 1 != enc_buf->seq) {
+		solo_enc_gop_clear(gop);
+		return NULL;
+	}
+
+	while (gop->nr && (gop->nr >= SOLO_ENC_CACHE_FRAMES ||
+			   gop->bytes + size > limit)) {
+		if (!key && list_first_entry(&gop->frames,
+				struct solo_enc_gop_frame, list) == gop->key) {
+			solo_enc_gop_clear(gop);
+			return NULL;
+		}
+		solo_enc_gop_trim(gop);
+	}
+
+	if (size > limit)
+		return NULL;
+
+	gf = kvmalloc(sizeof(*gf) + size, GFP_KERNEL);
+	if (gf == NULL) {
+		solo_enc_gop_clear(gop);
+		return NULL;
+	}
+
+	kref_init(&gf->kref);
+	gf->fbuf.data = gf + 1;
+	gf->fbuf.size = size;
+	gf->fbuf.flags = flags;
+	gf->enc_buf = *enc_buf;
+
+	list_add_tail(&gf->list, &gop->frames);
+	gop->nr++;
+	gop->bytes += size;
+
+	if (key) {
+		gop->key = gf;
+		solo_enc_gop_expire(gop, secs, solo_enc_gop_usec(gf));
+	}
+
+	return gf;
+}
+
+/* Cache the frame from the channel's shared MPEG buffer, fetching it
+ * into that first if need be. MUST be called with solo_enc->enable_lock
+ * held */
+static struct solo_enc_gop_frame *solo_enc_gop_add_shared(
+		struct solo_enc_dev *solo_enc, struct solo_enc_buf *enc_buf,
+		struct solo_enc_frame_buf **fbuf, int *fetched)
+{
+	struct solo_enc_frame_buf *shared;
+	struct solo_enc_gop_frame *gf;
+
+	shared = solo_enc_shared_frame(solo_enc, enc_buf, 0, fbuf, fetched);
+	if (shared == NULL) {
+		solo_enc_gop_clear(&solo_enc->gop[enc_buf->type]);
+		return NULL;
+	}
+
+	gf = solo_enc_gop_add(solo_enc, enc_buf, shared->size, shared->flags);
+	if (gf)
+		memcpy(gf->fbuf.data, shared->data, shared->size);
+
+	return gf;
+}
+
+/* Cache the frame from the buffer it was just DMA'd into, before that
+ * goes back to userspace. MUST be called with solo_enc->enable_lock
+ * held */
+static struct solo_enc_gop_frame *solo_enc_gop_add_vb(
+		struct solo_enc_dev *solo_enc, struct solo_enc_buf *enc_buf,
+		struct vb2_buffer *vb)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct sg_table *sgt = vb2_dma_sg_plane_desc(vb, 0);
+	size_t size = vb2_get_plane_payload(vb, 0);
+	struct solo_enc_gop_frame *gf;
+
+	gf = solo_enc_gop_add(solo_enc, enc_buf, size, vbuf->flags &
+			      (V4L2_BUF_FLAG_KEYFRAME | V4L2_BUF_FLAG_PFRAME));
+	if (gf == NULL)
+		return NULL;
+
+	dma_sync_sg_for_cpu(&solo_enc->solo_dev->pdev->dev, sgt->sgl,
+			    sgt->orig_nents, DMA_FROM_DEVICE);
+	if (sg_copy_to_buffer(sgt->sgl, sgt->orig_nents, gf->fbuf.data,
+			      size) != size) {
+		solo_enc_gop_clear(&solo_enc->gop[enc_buf->type]);
+		return NULL;
+	}
+
+	return gf;
+}
+
+static int solo_enc_replay_alloc(struct solo_enc_fh *fh)
+{
+	if (fh->replay == NULL)
+		fh->replay = kvmalloc(SOLO_ENC_REPLAY_FRAMES *
+				      sizeof(*fh->replay), GFP_KERNEL);
+
+	return fh->replay ? 0 : -ENOMEM;
+}
+
+static int solo_enc_replay_push(struct solo_enc_fh *fh,
+				struct solo_enc_gop_frame *gf)
+{
+	unsigned int tail;
+
+	if (fh->replay_nr == SOLO_ENC_REPLAY_FRAMES)
+		return -ENOSPC;
+
+	kref_get(&gf->kref);
+	tail = (fh->replay_head + fh->replay_nr) % SOLO_ENC_REPLAY_FRAMES;
+	fh->replay[tail] = gf;
+	fh->replay_nr++;
+
+	return 0;
+}
+
+/* Hand out as much of the backlog as there are buffers queued for. MUST
+ * be called with solo_enc->enable_lock held */
+static void solo_enc_replay_drain(struct solo_enc_fh *fh)
+{
+	while (fh->replay_nr) {
+		struct solo_enc_gop_frame *gf = fh->replay[fh->replay_head];
+		struct solo_vb2_buf *svb = solo_enc_next_buf(fh);
+
+		if (svb == NULL)
+			break;
+
+		solo_enc_fillbuf(fh, fh->enc, &svb->vb.vb2_buf, &gf->enc_buf,
+				 &gf->fbuf);
+		solo_enc_gop_frame_put(gf);
+		fh->replay_head = (fh->replay_head + 1) %
+			SOLO_ENC_REPLAY_FRAMES;
+		fh->replay_nr--;
+	}
+}
+
+/* Start a new MPEG reader off with the cached GOP, so that its first
+ * frame is a keyframe that is already here, or with the whole pre-roll
+ * if it asked for that. A ring takes the lot at once. Buffered readers
+ * get what fits now, and the rest as they queue more buffers; live
+ * frames wait behind it until the backlog is gone. MUST be called with
+ * solo_enc->enable_lock held, right after the handle went on the
+ * listener list, so that no live frame gets in first. */
+static void solo_enc_replay_start(struct solo_enc_fh *fh)
+{
+	struct solo_enc_dev *solo_enc = fh->enc;
+	struct solo_enc_gop *gop = &solo_enc->gop[fh->type];
+	struct solo_enc_gop_frame *gf;
+
+	if (fh->preroll && !list_empty(&gop->frames))
+		gf = list_first_entry(&gop->frames, struct solo_enc_gop_frame,
+				      list);
+	else
+		gf = gop->key;
+	fh->preroll = 0;
+
+	if (fh->fmt != V4L2_PIX_FMT_MPEG || gf == NULL)
+		return;
+
+	if (!fh->ring && solo_enc_replay_alloc(fh))
+		return;
+
+	list_for_each_entry_from(gf, &gop->frames, list) {
+		if (fh->ring)
+			solo_enc_ring_put(fh, solo_enc, &gf->enc_buf,
+					  &gf->fbuf);
+		else
+			solo_enc_replay_push(fh, gf);
+	}
+
+	solo_enc_replay_drain(fh);
+}
+
+static int solo_enc_on(struct solo_enc_fh *fh)
+{
+	struct solo_enc_dev *solo_enc = fh->enc;
+	int ret = 0;
+
+	mutex_lock(&solo_enc->enable_lock);
+	if (!fh->enc_on) {
+		ret = __solo_enc_on(fh);
+		if (!ret)
+			solo_enc_replay_start(fh);
+	}
+	mutex_unlock(&solo_enc->enable_lock);
+
+	return ret;
+}
+
+static void solo_enc_drop(struct solo_enc_dev *solo_enc,
+			  struct solo_enc_fh *fh, int why)
+{
+	atomic_inc(&solo_enc->drops[why]);
+	if (fh)
+		atomic_inc(&fh->drops);
+}
+
+/* Decide whether the motion gate holds this frame back. Keyframes always
+ * go. A P-frame that reopens the gate in the middle of a GOP only goes if
+ * the frames held back before it are all still in the GOP cache; *from
+ * is then the first of them, for the listeners to be given first. If
+ * they aren't, the gate stays shut until the next keyframe. Called before
+ * this frame is cached. MUST be called with solo_enc->enable_lock held */
+static int solo_enc_gate(struct solo_enc_dev *solo_enc,
+			 struct solo_enc_buf *enc_buf,
+			 struct solo_enc_gop_frame **from)
+{
+	struct solo_enc_gop *gop = &solo_enc->gop[enc_buf->type];
+	u64 now = (u64)enc_buf->vh.sec * USEC_PER_SEC + enc_buf->vh.usec;
+	int t = enc_buf->type;
+	struct solo_enc_gop_frame *f;
+	int open = 1;
+
+	*from = NULL;
+
+	if (solo_enc->gate_hold && solo_is_motion_on(solo_enc)) {
+		if (enc_buf->motion)
+			solo_enc->gate_motion = now;
+		open = solo_enc->gate_motion && now < solo_enc->gate_motion +
+			(u64)solo_enc->gate_hold * USEC_PER_SEC;
+	}
+
+	if (!enc_buf->vh.vop_type) {
+		solo_enc->gate_held[t] = 0;
+		return 0;
+	}
+
+	if (!open) {
+		if (!solo_enc->gate_held[t]) {
+			solo_enc->gate_held[t] = 1;
+			solo_enc->gate_from[t] = enc_buf->seq;
+		}
+		return 1;
+	}
+
+	if (!solo_enc->gate_held[t])
+		return 0;
 
-		solo_enc_fillbuf(fh, vb, enc_buf);
+	if (gop->key == NULL ||
+	    list_last_entry(&gop->frames, struct solo_enc_gop_frame,
+			    list)->enc_buf.seq + 1 != enc_buf->seq)
+		return 1;
+
+	f = gop->key;
+	list_for_each_entry_from(f, &gop->frames, list) {
+		if (f->enc_buf.seq == solo_enc->gate_from[t]) {
+			*from = f;
+			solo_enc->gate_held[t] = 0;
+			return 0;
+		}
 	}
 
+	return 1;
+}
+
+/* Take a reference on each cached frame from the first one on, for use
+ * outside enable_lock. */
+static struct solo_enc_gop_frame **solo_enc_gop_span(
+		struct solo_enc_gop *gop, struct solo_enc_gop_frame *first,
+		unsigned int *nr)
+{
+	struct solo_enc_gop_frame **span;
+	struct solo_enc_gop_frame *gf = first;
+	unsigned int n = 0;
+
+	list_for_each_entry_from(gf, &gop->frames, list)
+		n++;
+
+	*nr = 0;
+	span = kmalloc_array(n, sizeof(*span), GFP_KERNEL);
+	if (span == NULL)
+		return NULL;
+
+	gf = first;
+	list_for_each_entry_from(gf, &gop->frames, list) {
+		kref_get(&gf->kref);
+		span[(*nr)++] = gf;
+	}
+
+	return span;
+}
+
+static void solo_enc_gop_span_put(struct solo_enc_gop_frame **span,
+				  unsigned int nr)
+{
+	while (nr)
+		solo_enc_gop_frame_put(span[--nr]);
+	kfree(span);
+}
+
+/* Give a listener the frames the motion gate held back. A channel's own
+ * handles queue them up like a replay, the all-channel node gets what
+ * its queued buffers take. */
+static void solo_enc_backfill(struct solo_enc_fh *fh,
+			      struct solo_enc_dev *solo_enc,
+			      struct solo_enc_gop_frame **span,
+			      unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		struct solo_enc_gop_frame *gf = span[i];
+		struct solo_vb2_buf *svb;
+
+		if (fh->ring) {
+			solo_enc_ring_put(fh, solo_enc, &gf->enc_buf,
+					  &gf->fbuf);
+			continue;
+		}
+
+		if (fh->enc) {
+			if (solo_enc_replay_alloc(fh) ||
+			    solo_enc_replay_push(fh, gf))
+				solo_enc_drop(solo_enc, fh,
+					      SOLO_ENC_DROP_NOBUF);
+			continue;
+		}
+
+		svb = solo_enc_next_buf(fh);
+		if (svb)
+			solo_enc_fillbuf(fh, solo_enc, &svb->vb.vb2_buf,
+					 &gf->enc_buf, &gf->fbuf);
+		else
+			solo_enc_drop(solo_enc, fh, SOLO_ENC_DROP_NOBUF);
+	}
+}
+
+/* Has the hardware written a whole ring's worth since this frame? This
+ * only knows about what the ring thread has seen so far, so it can miss
+ * a frame that is being overwritten right now, but never flags a good
+ * one. */
+static int solo_enc_overwritten(struct solo_enc_dev *solo_enc,
+				struct solo_enc_buf *enc_buf)
+{
+	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	u64 written = atomic64_read(&solo_dev->enc_ring_pos) -
+		      enc_buf->ring_pos;
+
+	return written + sizeof(enc_buf->vh) + enc_buf->vh.mpeg_size >
+		SOLO_MP4E_EXT_SIZE(solo_dev);
+}
+
+/* Listeners that want the same format share a single transfer from
+ * SDRAM; a lone listener still gets the frame DMA'd straight into its
+ * buffer, and the GOP cache copies it from there. The all-channel node
+ * always takes the shared copy, since its handles are filled from every
+ * channel's worker at once. */
+static void solo_enc_handle_one(struct solo_enc_dev *solo_enc,
+				struct solo_enc_buf *enc_buf)
+{
+	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	struct solo_enc_frame_buf *fbuf[2] = { NULL, NULL };
+	int fetched[2] = { 0, 0 };
+	int waiting[2] = { 0, 0 };
+	int mux_want[2] = { 0, 0 };
+	struct solo_enc_gop *gop = &solo_enc->gop[enc_buf->type];
+	struct solo_enc_gop_frame *gf = NULL;
+	struct solo_enc_gop_frame **span = NULL;
+	struct solo_enc_gop_frame *from;
+	unsigned int span_nr = 0;
+	struct solo_enc_fh *fh;
+	int mpeg = 0, direct = 0;
+	int stale, cache;
+
+	/* Only the MPEG payload can be stale, JPEG has a ring of its own */
+	stale = solo_enc_overwritten(solo_enc, enc_buf);
+	if (stale)
+		solo_enc_drop(solo_enc, NULL, SOLO_ENC_DROP_OVERWRITE);
+
+	mutex_lock(&solo_enc->enable_lock);
+
+	/* Settings changed while running are taken from this GOP on */
+	if (!enc_buf->vh.vop_type && READ_ONCE(solo_enc->reconf))
+		solo_enc_reconf(solo_enc);
+
+	/* Carry on the GOP cache while anyone takes MPEG */
+	cache = !stale && solo_enc_gop_limit(solo_enc, enc_buf->type) &&
+		atomic_read(&solo_enc->mpeg_readers) > 0;
+	if (!cache)
+		solo_enc_gop_clear(gop);
+
+	/* A held back frame isn't even fetched, unless a pre-roll or
+	 * gate_cache asks for it to be cached. Without it the cache loses
+	 * track of the GOP, and the gate then stays shut until the next
+	 * keyframe. */
+	if (solo_enc_gate(solo_enc, enc_buf, &from)) {
+		if (cache && (gate_cache || solo_enc->preroll[enc_buf->type]))
+			solo_enc_gop_add_shared(solo_enc, enc_buf, fbuf,
+						fetched);
+		mutex_unlock(&solo_enc->enable_lock);
+		return;
+	}
+
+	if (from)
+		span = solo_enc_gop_span(gop, from, &span_nr);
+
+	list_for_each_entry(fh, &solo_enc->listeners, list) {
+		int jpeg = fh->fmt != V4L2_PIX_FMT_MPEG;
+
+		if (fh->type != enc_buf->type)
+			continue;
+
+		if (!list_empty(&fh->vidq_active))
+			waiting[jpeg]++;
+		if (!jpeg) {
+			mpeg++;
+			direct = !fh->ring && !fh->replay_nr;
+		}
+	}
+
+	/* With a lone MPEG listener that has nothing to catch up on, the
+	 * cache copies the frame out of its buffer. Anything else takes
+	 * the shared copy, which the cache is filled from up front so that
+	 * frames can be queued behind a backlog. */
+	direct = direct && mpeg == 1 && waiting[0] == 1 && !span_nr;
+	if (cache && !direct)
+		gf = solo_enc_gop_add_shared(solo_enc, enc_buf, fbuf, fetched);
+
+	list_for_each_entry(fh, &solo_enc->listeners, list) {
+		struct solo_enc_frame_buf *shared = NULL;
+		struct solo_vb2_buf *svb;
+		int jpeg = fh->fmt != V4L2_PIX_FMT_MPEG;
+		int ret;
+
+		if (fh->type != enc_buf->type || (stale && !jpeg))
+			continue;
+
+		if (!jpeg)
+			solo_enc_backfill(fh, solo_enc, span, span_nr);
+
+		if (fh->ring) {
+			shared = solo_enc_shared_frame(solo_enc, enc_buf, jpeg,
+						       fbuf, fetched);
+			if (shared)
+				solo_enc_ring_put(fh, solo_enc, enc_buf,
+						  shared);
+			continue;
+		}
+
+		/* Still working through the cached GOP, this frame has
+		 * to go behind it */
+		if (fh->replay_nr) {
+			solo_enc_replay_drain(fh);
+			if (fh->replay_nr && gf &&
+			    !solo_enc_replay_push(fh, gf))
+				continue;
+
+			/* No way to keep it in order, give up on the rest
+			 * of the backlog */
+			if (fh->replay_nr) {
+				atomic_add(fh->replay_nr, &fh->drops);
+				atomic_add(fh->replay_nr, &solo_enc->drops[
+					   SOLO_ENC_DROP_NOBUF]);
+				solo_enc_replay_flush(fh);
+			}
+		}
+
+		if (list_empty(&fh->vidq_active)) {
+			solo_enc_drop(solo_enc, fh, SOLO_ENC_DROP_NOBUF);
+			continue;
+		}
+
+		if (waiting[jpeg] > 1 || fetched[jpeg])
+			shared = solo_enc_shared_frame(solo_enc, enc_buf, jpeg,
+						       fbuf, fetched);
+
+		svb = solo_enc_next_buf(fh);
+		if (svb == NULL) {
+			solo_enc_drop(solo_enc, fh, SOLO_ENC_DROP_NOBUF);
+			continue;
+		}
+
+		ret = __solo_enc_fillbuf(fh, solo_enc, &svb->vb.vb2_buf,
+					 enc_buf, shared);
+		if (cache && direct && !jpeg) {
+			if (!ret)
+				gf = solo_enc_gop_add_vb(solo_enc, enc_buf,
+							 &svb->vb.vb2_buf);
+			else
+				solo_enc_gop_clear(gop);
+			direct = 0;
+		}
+		solo_enc_buf_done(&svb->vb.vb2_buf, ret);
+	}
+
+	/* The lone listener didn't get to take it after all */
+	if (cache && direct)
+		solo_enc_gop_add_shared(solo_enc, enc_buf, fbuf, fetched);
+
 	mutex_unlock(&solo_enc->enable_lock);
+
+	/* enc_mux_lock is shared by every channel's worker, so only look
+	 * up what the all-channel handles want under it, and do the
+	 * transfers from SDRAM without it */
+	mutex_lock(&solo_dev->enc_mux_lock);
+	list_for_each_entry(fh, &solo_dev->enc_mux_listeners, list) {
+		int jpeg = fh->fmt != V4L2_PIX_FMT_MPEG;
+
+		if (!(fh->chan_mask & (1 << solo_enc->ch)) ||
+		    fh->type != enc_buf->type || (stale && !jpeg))
+			continue;
+
+		if (fh->ring || !list_empty(&fh->vidq_active))
+			mux_want[jpeg] = 1;
+	}
+	mutex_unlock(&solo_dev->enc_mux_lock);
+
+	if (mux_want[0])
+		solo_enc_shared_frame(solo_enc, enc_buf, 0, fbuf, fetched);
+	if (mux_want[1])
+		solo_enc_shared_frame(solo_enc, enc_buf, 1, fbuf, fetched);
+
+	mutex_lock(&solo_dev->enc_mux_lock);
+
+	list_for_each_entry(fh, &solo_dev->enc_mux_listeners, list) {
+		struct solo_enc_frame_buf *shared;
+		struct solo_vb2_buf *svb;
+		int jpeg = fh->fmt != V4L2_PIX_FMT_MPEG;
+
+		if (!(fh->chan_mask & (1 << solo_enc->ch)) ||
+		    fh->type != enc_buf->type || (stale && !jpeg))
+			continue;
+
+		if (!jpeg)
+			solo_enc_backfill(fh, solo_enc, span, span_nr);
+
+		if (!fh->ring && list_empty(&fh->vidq_active)) {
+			solo_enc_drop(solo_enc, fh, SOLO_ENC_DROP_NOBUF);
+			continue;
+		}
+
+		/* A handle that turned up since the lookup above starts
+		 * with the next frame */
+		shared = fetched[jpeg] ? fbuf[jpeg] : NULL;
+		if (shared == NULL)
+			continue;
+
+		if (fh->ring) {
+			solo_enc_ring_put(fh, solo_enc, enc_buf, shared);
+			continue;
+		}
+
+		svb = solo_enc_next_buf(fh);
+		if (svb)
+			solo_enc_fillbuf(fh, solo_enc, &svb->vb.vb2_buf,
+					 enc_buf, shared);
+		else
+			solo_enc_drop(solo_enc, fh, SOLO_ENC_DROP_NOBUF);
+	}
+
+	mutex_unlock(&solo_dev->enc_mux_lock);
+
+	solo_enc_gop_span_put(span, span_nr);
+}
+
+/* Hand the replay backlogs whatever buffers were queued for them since
+ * the last frame. */
+static void solo_enc_replay_catchup(struct solo_enc_dev *solo_enc)
+{
+	struct solo_enc_fh *fh;
+
+	mutex_lock(&solo_enc->enable_lock);
+	list_for_each_entry(fh, &solo_enc->listeners, list) {
+		if (fh->replay_nr)
+			solo_enc_replay_drain(fh);
+	}
+	mutex_unlock(&solo_enc->enable_lock);
+}
+
+/* Runs on the encoder workqueue, so that channels fill their listeners'
+ * buffers in parallel. A channel's work is never run concurrently with
+ * itself, which keeps its frames in order. */
+static void solo_enc_work(struct work_struct *work)
+{
+	struct solo_enc_dev *solo_enc =
+		container_of(work, struct solo_enc_dev, work);
+	struct solo_enc_buf enc_buf;
+	unsigned long flags;
+
+	solo_enc_replay_catchup(solo_enc);
+
+	for (;;) {
+		spin_lock_irqsave(&solo_enc->frame_lock, flags);
+		if (solo_enc->frame_tail == solo_enc->frame_head) {
+			spin_unlock_irqrestore(&solo_enc->frame_lock, flags);
+			break;
+		}
+		enc_buf = solo_enc->frames[solo_enc->frame_tail];
+		solo_enc->frame_tail = (solo_enc->frame_tail + 1) %
+			SOLO_ENC_FRAME_QS;
+		spin_unlock_irqrestore(&solo_enc->frame_lock, flags);
+
+		solo_enc_handle_one(solo_enc, &enc_buf);
+	}
+}
+
+/* Queue a frame for the channel's worker. If it has fallen a whole queue
+ * behind, the new frame is dropped. */
+static void solo_enc_queue_frame(struct solo_enc_dev *solo_enc,
+				 struct solo_enc_buf *enc_buf)
+{
+	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	unsigned long flags;
+	unsigned int next;
+
+	spin_lock_irqsave(&solo_enc->frame_lock, flags);
+	next = (solo_enc->frame_head + 1) % SOLO_ENC_FRAME_QS;
+	if (next != solo_enc->frame_tail) {
+		solo_enc->frames[solo_enc->frame_head] = *enc_buf;
+		solo_enc->frame_head = next;
+	} else {
+		solo_enc_drop(solo_enc, NULL, SOLO_ENC_DROP_QUEUE);
+	}
+	spin_unlock_irqrestore(&solo_enc->frame_lock, flags);
+
+	queue_work(solo_dev->enc_wq, &solo_enc->work);
 }
 
 void solo_enc_v4l2_isr(struct solo_dev *solo_dev)
@@ -717,13 +1858,55 @@ void solo_enc_v4l2_isr(struct solo_dev *solo_dev)
 	wake_up_interruptible_all(&solo_dev->ring_thread_wait);
 }
 
+/* A frame the ring thread could not hand on still takes a sequence
+ * number, so that listeners see the gap */
+static void solo_enc_lost(struct solo_enc_dev *solo_enc, u32 que, int why)
+{
+	int type = ((que >> 24) & 0x1f) >= SOLO_MAX_CHANNELS ?
+		SOLO_ENC_TYPE_EXT : SOLO_ENC_TYPE_STD;
+
+	solo_enc->seq[type]++;
+	solo_enc_drop(solo_enc, NULL, why);
+}
+
+/* Follow the hardware's progress through the MPEG ring. Frames come out
+ * back to back, so a frame starting well past the end of the previous one
+ * means the frames in between had their queue entries overwritten before
+ * we got to read them. */
+static void solo_enc_track_ring(struct solo_dev *solo_dev,
+				struct solo_enc_buf *enc_buf)
+{
+	u32 size = SOLO_MP4E_EXT_SIZE(solo_dev);
+	u32 off = enc_buf->vh.mpeg_off;
+
+	if (solo_dev->enc_ring_valid) {
+		u32 dist = (off + size - solo_dev->enc_ring_off) % size;
+
+		if (dist > solo_dev->enc_ring_len + MP4E_RING_SLACK)
+			atomic_inc(&solo_dev->enc_hw_overruns);
+		atomic64_add(dist, &solo_dev->enc_ring_pos);
+	}
+
+	solo_dev->enc_ring_off = off;
+	solo_dev->enc_ring_len = sizeof(enc_buf->vh) + enc_buf->vh.mpeg_size;
+	solo_dev->enc_ring_valid = 1;
+
+	enc_buf->ring_pos = atomic64_read(&solo_dev->enc_ring_pos);
+}
+
+/* Fetch the VOP headers for every pending queue entry with one chained
+ * transfer, bar any across the end of the ring, then hand the frames out
+ * to each channel's worker. */
 static void solo_handle_ring(struct solo_dev *solo_dev)
 {
+	struct solo_p2m_desc desc[MP4_QS + 1];
+	u32 que[MP4_QS];
+
 	for (;;) {
-		struct solo_enc_dev *solo_enc;
-		struct solo_enc_buf enc_buf;
-		u32 mpeg_current, off;
-		u8 ch;
+		struct vop_header *vh = solo_dev->vh_buf;
+		int desc_cnt = 1;
+		int nr = 0;
+		int i;
 		u8 cur_q;
 
 		/* Check if the hardware has any new ones in the queue */
@@ -731,45 +1914,110 @@ static void solo_handle_ring(struct solo_dev *solo_dev)
 		if (cur_q == solo_dev->enc_idx)
 			break;
 
-		mpeg_current = solo_reg_read(solo_dev,
+		while (solo_dev->enc_idx != cur_q && nr < MP4_QS) {
+			u32 off;
+			u8 ch;
+
+			que[nr] = solo_reg_read(solo_dev,
 					SOLO_VE_MPEG4_QUE(solo_dev->enc_idx));
-		solo_dev->enc_idx = (solo_dev->enc_idx + 1) % MP4_QS;
+			solo_dev->enc_idx = (solo_dev->enc_idx + 1) % MP4_QS;
 
-		ch = (mpeg_current >> 24) & 0x1f;
-		off = mpeg_current & 0x00ffffff;
+			ch = (que[nr] >> 24) & 0x1f;
+			off = que[nr] & 0x00ffffff;
 
-		if (ch >= SOLO_MAX_CHANNELS) {
-			ch -= SOLO_MAX_CHANNELS;
-			enc_buf.type = SOLO_ENC_TYPE_EXT;
-		} else
-			enc_buf.type = SOLO_ENC_TYPE_STD;
+			if (ch >= SOLO_MAX_CHANNELS)
+				ch -= SOLO_MAX_CHANNELS;
 
-		solo_enc = solo_dev->v4l2_enc[ch];
-		if (solo_enc == NULL) {
-			dev_err(&solo_dev->pdev->dev,
-				"Got spurious packet for channel %d\n", ch);
-			continue;
+			if (solo_dev->v4l2_enc[ch] == NULL) {
+				dev_err(&solo_dev->pdev->dev,
+					"Got spurious packet for channel %d\n",
+					ch);
+				continue;
+			}
+
+			if (off > SOLO_MP4E_EXT_SIZE(solo_dev)) {
+				solo_enc_lost(solo_dev->v4l2_enc[ch], que[nr],
+					      SOLO_ENC_DROP_HEADER);
+				continue;
+			}
+
+			/* A header across the end of the ring is fetched on
+			 * its own, see solo_p2m_dma_ring() */
+			if (off + sizeof(*vh) > SOLO_MP4E_EXT_SIZE(solo_dev)) {
+				if (solo_p2m_dma_ring(solo_dev,
+					SOLO_P2M_CALLER_HEADER, 0,
+					solo_dev->vh_dma + nr * sizeof(*vh),
+					SOLO_MP4E_EXT_ADDR(solo_dev),
+					SOLO_MP4E_EXT_SIZE(solo_dev), off,
+					sizeof(*vh))) {
+					atomic_inc(&solo_dev->enc_hdr_errors);
+					solo_enc_lost(solo_dev->v4l2_enc[ch],
+						      que[nr],
+						      SOLO_ENC_DROP_HEADER);
+					continue;
+				}
+			} else {
+				solo_p2m_fill_desc(&desc[desc_cnt++], 0,
+					solo_dev->vh_dma + nr * sizeof(*vh),
+					SOLO_MP4E_EXT_ADDR(solo_dev) + off,
+					sizeof(*vh), 0, 0);
+			}
+			nr++;
 		}
 
-		/* FAIL... */
-		if (enc_get_mpeg_dma(solo_dev, solo_dev->vh_dma, off,
-				     sizeof(struct vop_header)))
+		if (!nr)
 			continue;
 
-		enc_buf.vh = (struct vop_header *)solo_dev->vh_buf;
-		enc_buf.vh->mpeg_off -= SOLO_MP4E_EXT_ADDR(solo_dev);
-		enc_buf.vh->jpeg_off -= SOLO_JPEG_EXT_ADDR(solo_dev);
-
-		/* Sanity check */
-		if (enc_buf.vh->mpeg_off != off)
+		if (desc_cnt > 1 &&
+		    solo_p2m_dma_desc(solo_dev, SOLO_P2M_CALLER_HEADER,
+				      desc, desc_cnt - 1)) {
+			atomic_inc(&solo_dev->enc_hdr_errors);
+			for (i = 0; i < nr; i++) {
+				u8 ch = (que[i] >> 24) & 0x1f;
+
+				if (ch >= SOLO_MAX_CHANNELS)
+					ch -= SOLO_MAX_CHANNELS;
+				solo_enc_lost(solo_dev->v4l2_enc[ch], que[i],
+					      SOLO_ENC_DROP_HEADER);
+			}
 			continue;
+		}
 
-		if (solo_motion_detected(solo_enc))
-			enc_buf.motion = 1;
-		else
-			enc_buf.motion = 0;
+		for (i = 0; i < nr; i++, vh++) {
+			struct solo_enc_dev *solo_enc;
+			struct solo_enc_buf enc_buf;
+			u8 ch = (que[i] >> 24) & 0x1f;
+			u32 off = que[i] & 0x00ffffff;
+
+			if (ch >= SOLO_MAX_CHANNELS) {
+				ch -= SOLO_MAX_CHANNELS;
+				enc_buf.type = SOLO_ENC_TYPE_EXT;
+			} else
+				enc_buf.type = SOLO_ENC_TYPE_STD;
+
+			solo_enc = solo_dev->v4l2_enc[ch];
+
+			enc_buf.vh = *vh;
+			enc_buf.vh.mpeg_off -= SOLO_MP4E_EXT_ADDR(solo_dev);
+			enc_buf.vh.jpeg_off -= SOLO_JPEG_EXT_ADDR(solo_dev);
+
+			/* Sanity check */
+			if (enc_buf.vh.mpeg_off != off) {
+				solo_enc_lost(solo_enc, que[i],
+					      SOLO_ENC_DROP_HEADER);
+				continue;
+			}
 
-		solo_enc_handle_one(solo_enc, &enc_buf);
+			solo_enc_track_ring(solo_dev, &enc_buf);
+			enc_buf.seq = solo_enc->seq[enc_buf.type]++;
+
+			if (solo_motion_detected(solo_enc))
+				enc_buf.motion = 1;
+			else
+				enc_buf.motion = 0;
+
+			solo_enc_queue_frame(solo_enc, &enc_buf);
+		}
 	}
 }
 
@@ -796,96 +2044,254 @@ static int solo_ring_thread(void *data)
 	return 0;
 }
 
-static int solo_enc_buf_setup(struct videobuf_queue *vq, unsigned int *count,
-			      unsigned int *size)
+static int solo_enc_queue_setup(struct vb2_queue *q,
+				unsigned int *num_buffers,
+				unsigned int *num_planes, unsigned int sizes[],
+				struct device *alloc_devs[])
 {
-	*size = FRAME_BUF_SIZE;
+	struct solo_enc_fh *fh = vb2_get_drv_priv(q);
+
+	if (*num_buffers < MIN_VID_BUFFERS)
+		*num_buffers = MIN_VID_BUFFERS;
 
-	if (*count < MIN_VID_BUFFERS)
-		*count = MIN_VID_BUFFERS;
+	if (*num_planes)
+		return sizes[0] < FRAME_BUF_SIZE ? -EINVAL : 0;
+
+	*num_planes = 1;
+	sizes[0] = FRAME_BUF_SIZE;
+	alloc_devs[0] = &fh->solo_dev->pdev->dev;
 
 	return 0;
 }
 
-static int solo_enc_buf_prepare(struct videobuf_queue *vq,
-				struct videobuf_buffer *vb,
-				enum v4l2_field field)
+static void solo_enc_buf_queue(struct vb2_buffer *vb)
 {
-	vb->size = FRAME_BUF_SIZE;
-	if (vb->baddr != 0 && vb->bsize < vb->size)
-		return -EINVAL;
+	struct solo_enc_fh *fh = vb2_get_drv_priv(vb->vb2_queue);
+	struct solo_vb2_buf *svb =
+		container_of(to_vb2_v4l2_buffer(vb), struct solo_vb2_buf, vb);
+	unsigned long flags;
 
-	/* This property only change when queue is idle */
-	vb->field = field;
+	spin_lock_irqsave(&fh->av_lock, flags);
+	list_add_tail(&svb->list, &fh->vidq_active);
+	spin_unlock_irqrestore(&fh->av_lock, flags);
 
-	if (vb->state == VIDEOBUF_NEEDS_INIT) {
-		int rc = videobuf_iolock(vq, vb, NULL);
-		if (rc < 0) {
-			struct videobuf_dmabuf *dma = videobuf_to_dma(vb);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
-			videobuf_dma_unmap(vq, dma);
-#else
-			videobuf_dma_unmap(vq->dev, dma);
-#endif
-			videobuf_dma_free(dma);
+	/* Have the worker catch up on the cached GOP without waiting for
+	 * the next frame. It holds enable_lock across its transfers, so
+	 * that is no lock to take from here. */
+	if (fh->enc && READ_ONCE(fh->replay_nr))
+		queue_work(fh->solo_dev->enc_wq, &fh->enc->work);
+}
 
-			return rc;
-		}
-	}
-	vb->state = VIDEOBUF_PREPARED;
+static void solo_enc_return_bufs(struct solo_enc_fh *fh,
+				 enum vb2_buffer_state state)
+{
+	struct solo_vb2_buf *svb, *tmp;
+	unsigned long flags;
 
-	return 0;
+	spin_lock_irqsave(&fh->av_lock, flags);
+	list_for_each_entry_safe(svb, tmp, &fh->vidq_active, list) {
+		list_del(&svb->list);
+		vb2_buffer_done(&svb->vb.vb2_buf, state);
+	}
+	spin_unlock_irqrestore(&fh->av_lock, flags);
 }
 
-static void solo_enc_buf_queue(struct videobuf_queue *vq,
-			       struct videobuf_buffer *vb)
+static int solo_enc_start_streaming(struct vb2_queue *q, unsigned int count)
 {
-	struct solo_enc_fh *fh = vq->priv_data;
+	struct solo_enc_fh *fh = vb2_get_drv_priv(q);
+	int ret;
+
+	if (fh->enc)
+		ret = solo_enc_on(fh);
+	else
+		ret = solo_enc_mux_on(fh);
+	if (ret)
+		solo_enc_return_bufs(fh, VB2_BUF_STATE_QUEUED);
 
-	vb->state = VIDEOBUF_QUEUED;
-	list_add_tail(&vb->queue, &fh->vidq_active);
+	return ret;
 }
 
-static void solo_enc_buf_release(struct videobuf_queue *vq,
-				 struct videobuf_buffer *vb)
+/* Once we are off the listener list no channel worker can still be
+ * holding one of our buffers, so whatever is left can be returned. */
+static void solo_enc_stop_streaming(struct vb2_queue *q)
 {
-	struct videobuf_dmabuf *dma = videobuf_to_dma(vb);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35)
-	videobuf_dma_unmap(vq, dma);
-#else
-	videobuf_dma_unmap(vq->dev, dma);
-#endif
-	videobuf_dma_free(dma);
-	vb->state = VIDEOBUF_NEEDS_INIT;
+	struct solo_enc_fh *fh = vb2_get_drv_priv(q);
+
+	if (fh->enc)
+		solo_enc_off(fh);
+	else
+		solo_enc_mux_off(fh);
+	solo_enc_return_bufs(fh, VB2_BUF_STATE_ERROR);
 }
 
-static const struct videobuf_queue_ops solo_enc_video_qops = {
-	.buf_setup	= solo_enc_buf_setup,
-	.buf_prepare	= solo_enc_buf_prepare,
-	.buf_queue	= solo_enc_buf_queue,
-	.buf_release	= solo_enc_buf_release,
+static const struct vb2_ops solo_enc_video_qops = {
+	.queue_setup		= solo_enc_queue_setup,
+	.buf_queue		= solo_enc_buf_queue,
+	.start_streaming	= solo_enc_start_streaming,
+	.stop_streaming		= solo_enc_stop_streaming,
+	.wait_prepare		= vb2_ops_wait_prepare,
+	.wait_finish		= vb2_ops_wait_finish,
 };
 
 static unsigned int solo_enc_poll(struct file *file,
 				  struct poll_table_struct *wait)
 {
 	struct solo_enc_fh *fh = file->private_data;
+	struct solo_enc_ring *ring;
+	unsigned int ret;
 
-	return videobuf_poll_stream(file, &fh->vidq, wait);
+	mutex_lock(&fh->lock);
+
+	ring = fh->ring;
+	if (ring) {
+		poll_wait(file, &ring->wait, wait);
+		ret = 0;
+		if (ring->idx_head != READ_ONCE(ring->ctl->idx_tail))
+			ret = POLLIN | POLLRDNORM;
+	} else {
+		ret = vb2_poll(&fh->vidq, file, wait);
+	}
+
+	mutex_unlock(&fh->lock);
+
+	return ret;
 }
 
 static int solo_enc_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct solo_enc_fh *fh = file->private_data;
+	int ret;
+
+	if (vma->vm_pgoff != SOLO_ENC_RING_MMAP_OFF >> PAGE_SHIFT)
+		return vb2_mmap(&fh->vidq, vma);
+
+	mutex_lock(&fh->lock);
+	if (fh->ring)
+		ret = remap_vmalloc_range(vma, fh->ring->mem, 0);
+	else
+		ret = -EINVAL;
+	mutex_unlock(&fh->lock);
+
+	return ret;
+}
+
+/* MUST be called with fh->lock held */
+static void solo_enc_ring_free(struct solo_enc_fh *fh)
+{
+	struct solo_enc_ring *ring = fh->ring;
+
+	if (ring == NULL)
+		return;
+
+	/* No worker can be writing to the ring once we are off the
+	 * listener lists */
+	if (fh->enc)
+		solo_enc_off(fh);
+	else
+		solo_enc_mux_off(fh);
+
+	fh->ring = NULL;
+	wake_up_interruptible(&ring->wait);
+
+	vfree(ring->mem);
+	kfree(ring->offs);
+	kfree(ring);
+}
+
+static int solo_enc_ring_setup(struct solo_enc_fh *fh,
+			       struct solo_enc_ring_setup *rs)
+{
+	struct solo_enc_ring *ring;
+	unsigned long idx_size;
+	int ret;
+
+	mutex_lock(&fh->lock);
+
+	if (rs->data_size == 0) {
+		solo_enc_ring_free(fh);
+		mutex_unlock(&fh->lock);
+		return 0;
+	}
+
+	if (fh->ring || vb2_is_busy(&fh->vidq)) {
+		mutex_unlock(&fh->lock);
+		return -EBUSY;
+	}
+
+	rs->data_size = clamp_t(u32, PAGE_ALIGN(rs->data_size),
+				RING_MIN_DATA, RING_MAX_DATA);
+	rs->nr_index = clamp_t(u32, rs->nr_index, 2, RING_MAX_INDEX);
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (ring == NULL) {
+		mutex_unlock(&fh->lock);
+		return -ENOMEM;
+	}
+
+	idx_size = PAGE_ALIGN(sizeof(struct solo_enc_ring_idx) *
+			      rs->nr_index);
+	ring->mem_size = PAGE_SIZE + idx_size + rs->data_size;
+	ring->mem = vmalloc_user(ring->mem_size);
+	ring->offs = kcalloc(rs->nr_index, sizeof(u32), GFP_KERNEL);
+	if (ring->mem == NULL || ring->offs == NULL) {
+		vfree(ring->mem);
+		kfree(ring->offs);
+		kfree(ring);
+		mutex_unlock(&fh->lock);
+		return -ENOMEM;
+	}
 
-	return videobuf_mmap_mapper(&fh->vidq, vma);
+	mutex_init(&ring->lock);
+	init_waitqueue_head(&ring->wait);
+	ring->data_size = rs->data_size;
+	ring->nr_index = rs->nr_index;
+	ring->ctl = ring->mem;
+	ring->idx = ring->mem + PAGE_SIZE;
+	ring->data = ring->mem + PAGE_SIZE + idx_size;
+
+	ring->ctl->data_size = ring->data_size;
+	ring->ctl->nr_index = ring->nr_index;
+	ring->ctl->idx_offset = PAGE_SIZE;
+	ring->ctl->data_offset = PAGE_SIZE + idx_size;
+
+	fh->ring = ring;
+
+	if (fh->enc)
+		ret = solo_enc_on(fh);
+	else
+		ret = solo_enc_mux_on(fh);
+	if (ret) {
+		fh->ring = NULL;
+		vfree(ring->mem);
+		kfree(ring->offs);
+		kfree(ring);
+		mutex_unlock(&fh->lock);
+		return ret;
+	}
+
+	rs->mmap_offset = SOLO_ENC_RING_MMAP_OFF;
+	rs->mmap_size = ring->mem_size;
+
+	mutex_unlock(&fh->lock);
+
+	return 0;
 }
 
 static int solo_ring_start(struct solo_dev *solo_dev)
 {
-	if (atomic_inc_return(&solo_dev->enc_users) > 1)
+	int users;
+
+	/* Waits out a P2M benchmark, which reads from the MP4E ring */
+	mutex_lock(&solo_dev->p2m_bench_lock);
+	users = atomic_inc_return(&solo_dev->enc_users);
+	mutex_unlock(&solo_dev->p2m_bench_lock);
+
+	if (users > 1)
 		return 0;
 
+	/* The ring thread picks up the hardware's position afresh */
+	solo_dev->enc_ring_valid = 0;
+
 	solo_dev->ring_thread = kthread_run(solo_ring_thread, solo_dev,
 					    SOLO6X10_NAME "_ring");
 	if (IS_ERR(solo_dev->ring_thread)) {
@@ -909,17 +2315,97 @@ static void solo_ring_stop(struct solo_dev *solo_dev)
 		solo_dev->ring_thread = NULL;
 	}
 
+	/* Nothing is queued once the ring thread is gone */
+	flush_workqueue(solo_dev->enc_wq);
+
 	solo_irq_off(solo_dev, SOLO_IRQ_ENCODER);
 }
 
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 28)
-static int solo_enc_open(struct file *file)
-#else
-static int solo_enc_open(struct inode *ino, struct file *file)
-#endif
+/* A pre-roll counts as an MPEG reader of its stream, and keeps the ring
+ * thread going, for as long as it is set. */
+static int solo_enc_preroll_set(struct solo_enc_dev *solo_enc,
+				enum solo_enc_types type, unsigned int secs)
 {
-	struct solo_enc_dev *solo_enc = video_drvdata(file);
 	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	int ring_put = 0;
+	int ret = 0;
+
+	mutex_lock(&solo_enc->enable_lock);
+
+	if (secs && !solo_enc->preroll[type]) {
+		ret = solo_ring_start(solo_dev);
+		if (!ret) {
+			ret = __solo_enc_start(solo_enc, V4L2_PIX_FMT_MPEG,
+					       type);
+			ring_put = ret != 0;
+		}
+	} else if (!secs && solo_enc->preroll[type]) {
+		__solo_enc_stop(solo_enc, V4L2_PIX_FMT_MPEG);
+		ring_put = 1;
+	}
+
+	if (!ret)
+		solo_enc->preroll[type] = secs;
+
+	mutex_unlock(&solo_enc->enable_lock);
+
+	/* Can't be done under enable_lock, it may wait on the workers */
+	if (ring_put)
+		solo_ring_stop(solo_dev);
+
+	return ret;
+}
+
+static int solo_enc_preroll_setup(struct solo_enc_fh *fh,
+				  struct solo_enc_preroll *pr)
+{
+	struct solo_enc_dev *solo_enc = fh->enc;
+	struct solo_enc_gop *gop;
+	int ret;
+
+	if (solo_enc == NULL)
+		return -ENOTTY;
+
+	pr->seconds = min_t(u32, pr->seconds, SOLO_ENC_PREROLL_MAX);
+
+	mutex_lock(&fh->lock);
+	ret = solo_enc_preroll_set(solo_enc, fh->type, pr->seconds);
+	mutex_unlock(&fh->lock);
+	if (ret)
+		return ret;
+
+	gop = &solo_enc->gop[fh->type];
+	mutex_lock(&solo_enc->enable_lock);
+	pr->frames = gop->nr;
+	pr->bytes = gop->bytes;
+	mutex_unlock(&solo_enc->enable_lock);
+
+	return 0;
+}
+
+static int solo_enc_preroll_drain(struct solo_enc_fh *fh)
+{
+	int ret = 0;
+
+	if (fh->enc == NULL)
+		return -ENOTTY;
+
+	mutex_lock(&fh->lock);
+	if (fh->fmt != V4L2_PIX_FMT_MPEG)
+		ret = -EINVAL;
+	else if (fh->enc_on)
+		ret = -EBUSY;
+	else
+		fh->preroll = 1;
+	mutex_unlock(&fh->lock);
+
+	return ret;
+}
+
+/* solo_enc is NULL for the all-channel node */
+static int solo_enc_fh_open(struct file *file, struct solo_dev *solo_dev,
+			    struct solo_enc_dev *solo_enc)
+{
 	struct solo_enc_fh *fh;
 	int ret;
 
@@ -933,56 +2419,77 @@ static int solo_enc_open(struct inode *ino, struct file *file)
 		return -ENOMEM;
 	}
 
-	fh->desc_nelts = 32;
-	fh->desc_items = pci_alloc_consistent(solo_dev->pdev,
-				      sizeof(struct solo_p2m_desc) *
-				      fh->desc_nelts, &fh->desc_dma);
-	if (fh->desc_items == NULL) {
-		kfree(fh);
-		solo_ring_stop(solo_dev);
-		return -ENOMEM;
-	}
-
 	fh->enc = solo_enc;
+	fh->solo_dev = solo_dev;
 	spin_lock_init(&fh->av_lock);
-	file->private_data = fh;
+	mutex_init(&fh->lock);
 	INIT_LIST_HEAD(&fh->vidq_active);
 	fh->fmt = V4L2_PIX_FMT_MPEG;
 	fh->type = SOLO_ENC_TYPE_STD;
 
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 37)
-	videobuf_queue_sg_init(&fh->vidq, &solo_enc_video_qops,
-				&solo_dev->pdev->dev,
-				&fh->av_lock,
-				V4L2_BUF_TYPE_VIDEO_CAPTURE,
-				V4L2_FIELD_INTERLACED,
-				sizeof(struct solo_videobuf),
-				fh, NULL);
+	fh->vidq.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	/* No DMABUF import: frames are copied in by the CPU, which would
+	 * need begin/end_cpu_access around every fill. Exporting works
+	 * with MMAP alone. */
+	fh->vidq.io_modes = VB2_MMAP | VB2_USERPTR | VB2_READ;
+	fh->vidq.drv_priv = fh;
+	fh->vidq.buf_struct_size = sizeof(struct solo_vb2_buf);
+	fh->vidq.ops = &solo_enc_video_qops;
+	fh->vidq.mem_ops = &vb2_dma_sg_memops;
+	fh->vidq.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN;
+	fh->vidq.lock = &fh->lock;
+	fh->vidq.dev = &solo_dev->pdev->dev;
+
+	ret = vb2_queue_init(&fh->vidq);
+	if (ret) {
+		kfree(fh);
+		solo_ring_stop(solo_dev);
+		return ret;
+	}
+
+	file->private_data = fh;
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 28)
+static int solo_enc_open(struct file *file)
 #else
-	videobuf_queue_sg_init(&fh->vidq, &solo_enc_video_qops,
-				&solo_dev->pdev->dev,
-				&fh->av_lock,
-				V4L2_BUF_TYPE_VIDEO_CAPTURE,
-				V4L2_FIELD_INTERLACED,
-				sizeof(struct solo_videobuf), fh);
+static int solo_enc_open(struct inode *ino, struct file *file)
 #endif
+{
+	struct solo_enc_dev *solo_enc = video_drvdata(file);
 
-	return 0;
+	return solo_enc_fh_open(file, solo_enc->solo_dev, solo_enc);
+}
+
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 28)
+static int solo_enc_mux_open(struct file *file)
+#else
+static int solo_enc_mux_open(struct inode *ino, struct file *file)
+#endif
+{
+	struct solo_dev *solo_dev = video_drvdata(file);
+
+	return solo_enc_fh_open(file, solo_dev, NULL);
 }
 
 static ssize_t solo_enc_read(struct file *file, char __user *data,
 			     size_t count, loff_t *ppos)
 {
 	struct solo_enc_fh *fh = file->private_data;
-	int ret;
+	ssize_t ret;
 
-	/* Make sure the encoder is on */
-	ret = solo_enc_on(fh);
-	if (ret)
-		return ret;
+	/* The encoder is turned on by the queue's start_streaming */
+	mutex_lock(&fh->lock);
+	if (fh->ring)
+		ret = -EBUSY;
+	else
+		ret = vb2_read(&fh->vidq, data, count, ppos,
+			       file->f_flags & O_NONBLOCK);
+	mutex_unlock(&fh->lock);
 
-	return videobuf_read_stream(&fh->vidq, data, count, ppos, 0,
-				    file->f_flags & O_NONBLOCK);
+	return ret;
 }
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 28)
@@ -992,17 +2499,19 @@ static int solo_enc_release(struct inode *ino, struct file *file)
 #endif
 {
 	struct solo_enc_fh *fh = file->private_data;
-	struct solo_dev *solo_dev = fh->enc->solo_dev;
-
-	solo_enc_off(fh);
+	struct solo_dev *solo_dev = fh->solo_dev;
 
-	videobuf_stop(&fh->vidq);
-	videobuf_mmap_free(&fh->vidq);
+	mutex_lock(&fh->lock);
+	vb2_queue_release(&fh->vidq);
+	solo_enc_ring_free(fh);
+	mutex_unlock(&fh->lock);
 
-	pci_free_consistent(fh->enc->solo_dev->pdev,
-			    sizeof(struct solo_p2m_desc) *
-			    fh->desc_nelts, fh->desc_items, fh->desc_dma);
+	if (fh->enc)
+		solo_enc_off(fh);
+	else
+		solo_enc_mux_off(fh);
 
+	kvfree(fh->replay);
 	kfree(fh);
 
 	solo_ring_stop(solo_dev);
@@ -1023,9 +2532,8 @@ static int solo_enc_querycap(struct file *file, void  *priv,
 	snprintf(cap->bus_info, sizeof(cap->bus_info), "PCI %s",
 		 pci_name(solo_dev->pdev));
 	cap->version = SOLO6X10_VER_NUM;
-	cap->capabilities =     V4L2_CAP_VIDEO_CAPTURE |
-				V4L2_CAP_READWRITE |
-				V4L2_CAP_STREAMING;
+	cap->device_caps = video_devdata(file)->device_caps;
+	cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
 	return 0;
 }
 
@@ -1189,58 +2697,89 @@ static int solo_enc_reqbufs(struct file *file, void *priv,
 			    struct v4l2_requestbuffers *req)
 {
 	struct solo_enc_fh *fh = priv;
+	int ret;
+
+	mutex_lock(&fh->lock);
+	if (fh->ring)
+		ret = -EBUSY;
+	else
+		ret = vb2_reqbufs(&fh->vidq, req);
+	mutex_unlock(&fh->lock);
 
-	return videobuf_reqbufs(&fh->vidq, req);
+	return ret;
 }
 
 static int solo_enc_querybuf(struct file *file, void *priv,
 			     struct v4l2_buffer *buf)
 {
 	struct solo_enc_fh *fh = priv;
+	int ret;
+
+	mutex_lock(&fh->lock);
+	ret = vb2_querybuf(&fh->vidq, buf);
+	mutex_unlock(&fh->lock);
 
-	return videobuf_querybuf(&fh->vidq, buf);
+	return ret;
 }
 
 static int solo_enc_qbuf(struct file *file, void *priv,
 			 struct v4l2_buffer *buf)
 {
 	struct solo_enc_fh *fh = priv;
+	int ret;
+
+	mutex_lock(&fh->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	ret = vb2_qbuf(&fh->vidq, NULL, buf);
+#else
+	ret = vb2_qbuf(&fh->vidq, buf);
+#endif
+	mutex_unlock(&fh->lock);
 
-	return videobuf_qbuf(&fh->vidq, buf);
+	return ret;
 }
 
+/* Frame type, motion and timestamp are carried in the vb2 buffer itself,
+ * so there is nothing left to patch up after the dequeue. */
 static int solo_enc_dqbuf(struct file *file, void *priv,
 			  struct v4l2_buffer *buf)
 {
 	struct solo_enc_fh *fh = priv;
-	struct solo_videobuf *svb;
 	int ret;
 
-	/* Make sure the encoder is on */
-	ret = solo_enc_on(fh);
-	if (ret)
-		return ret;
+	mutex_lock(&fh->lock);
+	ret = vb2_dqbuf(&fh->vidq, buf, file->f_flags & O_NONBLOCK);
+	mutex_unlock(&fh->lock);
 
-	ret = videobuf_dqbuf(&fh->vidq, buf, file->f_flags & O_NONBLOCK);
-	if (ret)
-		return ret;
+	return ret;
+}
 
-	/* Copy over the flags */
-	svb = (struct solo_videobuf *)fh->vidq.bufs[buf->index];
-	buf->flags |= svb->flags;
+/* Export a buffer as a DMABUF fd, so frames can be passed on without
+ * being copied through userspace */
+static int solo_enc_expbuf(struct file *file, void *priv,
+			   struct v4l2_exportbuffer *eb)
+{
+	struct solo_enc_fh *fh = priv;
+	int ret;
 
-	return 0;
+	mutex_lock(&fh->lock);
+	ret = vb2_expbuf(&fh->vidq, eb);
+	mutex_unlock(&fh->lock);
+
+	return ret;
 }
 
 static int solo_enc_streamon(struct file *file, void *priv,
 			     enum v4l2_buf_type i)
 {
 	struct solo_enc_fh *fh = priv;
+	int ret;
 
-	if (i != V4L2_BUF_TYPE_VIDEO_CAPTURE)
-		return -EINVAL;
+	mutex_lock(&fh->lock);
+	ret = vb2_streamon(&fh->vidq, i);
+	mutex_unlock(&fh->lock);
 
-	return videobuf_streamon(&fh->vidq);
+	return ret;
 }
 
 static int solo_enc_streamoff(struct file *file, void *priv,
@@ -1249,17 +2788,43 @@ static int solo_enc_streamoff(struct file *file, void *priv,
 	struct solo_enc_fh *fh = priv;
 	int ret;
 
-	if (i != V4L2_BUF_TYPE_VIDEO_CAPTURE)
-		return -EINVAL;
-
-	ret = videobuf_streamoff(&fh->vidq);
-	if (!ret)
-		solo_enc_off(fh);
+	mutex_lock(&fh->lock);
+	ret = vb2_streamoff(&fh->vidq, i);
+	mutex_unlock(&fh->lock);
 
 	return ret;
 }
 
-static int solo_enc_s_std(struct file *file, void *priv, v4l2_std_id *i)
+static long solo_enc_default(struct file *file, void *priv, bool valid_prio,
+			     unsigned int cmd, void *arg)
+{
+	struct solo_enc_fh *fh = priv;
+
+	switch (cmd) {
+	case VIDIOC_SOLO_RING_SETUP:
+		return solo_enc_ring_setup(fh, arg);
+	case VIDIOC_SOLO_PREROLL_SETUP:
+		return solo_enc_preroll_setup(fh, arg);
+	case VIDIOC_SOLO_PREROLL_DRAIN:
+		return solo_enc_preroll_drain(fh);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int solo_enc_g_std(struct file *file, void *priv, v4l2_std_id *i)
+{
+	struct solo_enc_fh *fh = priv;
+
+	if (fh->solo_dev->video_type == SOLO_VO_FMT_TYPE_NTSC)
+		*i = V4L2_STD_NTSC_M;
+	else
+		*i = V4L2_STD_PAL_B;
+
+	return 0;
+}
+
+static int solo_enc_s_std(struct file *file, void *priv, v4l2_std_id i)
 {
 	return 0;
 }
@@ -1341,14 +2906,11 @@ static int solo_s_parm(struct file *file, void *priv,
 	struct solo_enc_dev *solo_enc = fh->enc;
 	struct solo_dev *solo_dev = solo_enc->solo_dev;
 	struct v4l2_captureparm *cp = &sp->parm.capture;
+	u8 old_interval;
+	int ret;
 
 	mutex_lock(&solo_enc->enable_lock);
 
-	if (atomic_read(&solo_enc->mpeg_readers) > 0) {
-		mutex_unlock(&solo_enc->enable_lock);
-		return -EBUSY;
-	}
-
 	if ((cp->timeperframe.numerator == 0) ||
 	    (cp->timeperframe.denominator == 0)) {
 		/* reset framerate */
@@ -1369,106 +2931,33 @@ static int solo_s_parm(struct file *file, void *priv,
 	if (!(cp->timeperframe.numerator))
 		cp->timeperframe.numerator++;
 	
-	if (cp->timeperframe.numerator > 15)
-		cp->timeperframe.numerator = 15;
-
-	solo_enc->interval = cp->timeperframe.numerator;
-
-	cp->capability = V4L2_CAP_TIMEPERFRAME;
-
-	solo_update_mode(solo_enc);
-
-	mutex_unlock(&solo_enc->enable_lock);
-
-	return 0;
-}
-
-static int solo_queryctrl(struct file *file, void *priv,
-			  struct v4l2_queryctrl *qc)
-{
-	struct solo_enc_fh *fh = priv;
-	struct solo_enc_dev *solo_enc = fh->enc;
-	struct solo_dev *solo_dev = solo_enc->solo_dev;
-
-	qc->id = v4l2_ctrl_next(solo_ctrl_classes, qc->id);
-	if (!qc->id)
-		return -EINVAL;
-
-	switch (qc->id) {
-	case V4L2_CID_BRIGHTNESS:
-	case V4L2_CID_CONTRAST:
-	case V4L2_CID_SATURATION:
-	case V4L2_CID_HUE:
-		return v4l2_ctrl_query_fill(qc, 0x00, 0xff, 1, 0x80);
-	case V4L2_CID_SHARPNESS:
-		return v4l2_ctrl_query_fill(qc, 0x00, 0x0f, 1, 0x00);
-	case V4L2_CID_MPEG_VIDEO_ENCODING:
-		return v4l2_ctrl_query_fill(
-			qc, V4L2_MPEG_VIDEO_ENCODING_MPEG_1,
-			V4L2_MPEG_VIDEO_ENCODING_MPEG_4_AVC, 1,
-			V4L2_MPEG_VIDEO_ENCODING_MPEG_4_AVC);
-	case V4L2_CID_MPEG_VIDEO_GOP_SIZE:
-		return v4l2_ctrl_query_fill(qc, 1, 255, 1, solo_dev->fps);
-#ifdef PRIVATE_CIDS
-	case V4L2_CID_MOTION_THRESHOLD:
-		qc->flags |= V4L2_CTRL_FLAG_SLIDER;
-		qc->type = V4L2_CTRL_TYPE_INTEGER;
-		qc->minimum = 0;
-		qc->maximum = 0xffff;
-		qc->step = 1;
-		qc->default_value = SOLO_DEF_MOT_THRESH;
-		strlcpy(qc->name, "Motion Detection Threshold",
-			sizeof(qc->name));
-		return 0;
-	case V4L2_CID_MOTION_ENABLE:
-		qc->type = V4L2_CTRL_TYPE_BOOLEAN;
-		qc->minimum = 0;
-		qc->maximum = qc->step = 1;
-		qc->default_value = 0;
-		strlcpy(qc->name, "Motion Detection Enable", sizeof(qc->name));
-		return 0;
-#else
-	case V4L2_CID_MOTION_THRESHOLD:
-		return v4l2_ctrl_query_fill(qc, 0, 0xffff, 1,
-					    SOLO_DEF_MOT_THRESH);
-	case V4L2_CID_MOTION_ENABLE:
-		return v4l2_ctrl_query_fill(qc, 0, 1, 1, 0);
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
-	case V4L2_CID_RDS_TX_RADIO_TEXT:
-		qc->type = V4L2_CTRL_TYPE_STRING;
-		qc->minimum = 0;
-		qc->maximum = OSD_TEXT_MAX;
-		qc->step = 1;
-		qc->default_value = 0;
-		strlcpy(qc->name, "OSD Text", sizeof(qc->name));
-		return 0;
-#endif
-	}
+	if (cp->timeperframe.numerator > SOLO_ENC_INTERVAL_MAX)
+		cp->timeperframe.numerator = SOLO_ENC_INTERVAL_MAX;
 
-	return -EINVAL;
-}
+	old_interval = solo_enc->interval;
+	solo_enc->interval = cp->timeperframe.numerator;
 
-static int solo_querymenu(struct file *file, void *priv,
-			  struct v4l2_querymenu *qmenu)
-{
-	struct v4l2_queryctrl qctrl;
-	int err;
+	/* A running channel is reprogrammed at its next keyframe */
+	mutex_lock(&solo_dev->enc_sched_lock);
+	ret = solo_enc_sched(solo_dev, NULL);
+	if (ret)
+		solo_enc->interval = old_interval;
+	mutex_unlock(&solo_dev->enc_sched_lock);
+
+	cp->capability = V4L2_CAP_TIMEPERFRAME;
 
-	qctrl.id = qmenu->id;
+	if (!atomic_read(&solo_enc->readers))
+		solo_update_mode(solo_enc);
 
-	err = solo_queryctrl(file, priv, &qctrl);
-	if (err)
-		return err;
+	mutex_unlock(&solo_enc->enable_lock);
 
-	return v4l2_ctrl_query_menu(qmenu, &qctrl, NULL);
+	return ret;
 }
 
-static int solo_g_ctrl(struct file *file, void *priv,
-		       struct v4l2_control *ctrl)
+static int solo_enc_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
 {
-	struct solo_enc_fh *fh = priv;
-	struct solo_enc_dev *solo_enc = fh->enc;
+	struct solo_enc_dev *solo_enc =
+		container_of(ctrl->handler, struct solo_enc_dev, hdl);
 	struct solo_dev *solo_dev = solo_enc->solo_dev;
 
 	switch (ctrl->id) {
@@ -1478,34 +2967,52 @@ static int solo_g_ctrl(struct file *file, void *priv,
 	case V4L2_CID_HUE:
 	case V4L2_CID_SHARPNESS:
 		return tw28_get_ctrl_val(solo_dev, ctrl->id, solo_enc->ch,
-					 &ctrl->value);
-	case V4L2_CID_MPEG_VIDEO_ENCODING:
-		ctrl->value = V4L2_MPEG_VIDEO_ENCODING_MPEG_4_AVC;
-		break;
-	case V4L2_CID_MPEG_VIDEO_GOP_SIZE:
-		if (atomic_read(&solo_enc->readers) > 0)
-			return -EBUSY;
-		ctrl->value = solo_enc->gop;
-		break;
+					 &ctrl->val);
 	case V4L2_CID_MOTION_THRESHOLD:
-		ctrl->value = solo_enc->motion_thresh;
-		break;
-	case V4L2_CID_MOTION_ENABLE:
-		ctrl->value = solo_is_motion_on(solo_enc);
-		break;
-	default:
-		return -EINVAL;
+		ctrl->val = solo_enc->motion_thresh;
+		return 0;
 	}
 
-	return 0;
+	return -EINVAL;
 }
 
-static int solo_s_ctrl(struct file *file, void *priv,
-		       struct v4l2_control *ctrl)
+/* Scheduling controls are refused if the budget can no longer be met
+ * with them. Otherwise the new intervals are worked out right away, but
+ * running channels only change over at their next keyframe, see
+ * solo_enc_reconf(). */
+static int solo_enc_sched_ctrl(struct solo_enc_dev *solo_enc, u32 id,
+			       s32 val)
 {
-	struct solo_enc_fh *fh = priv;
-	struct solo_enc_dev *solo_enc = fh->enc;
 	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	u8 old_priority = solo_enc->priority;
+	u8 old_interval = solo_enc->max_interval;
+	int ret;
+
+	mutex_lock(&solo_dev->enc_sched_lock);
+
+	if (id == V4L2_CID_ENC_PRIORITY)
+		solo_enc->priority = val;
+	else
+		solo_enc->max_interval = val;
+
+	ret = solo_enc_sched(solo_dev, NULL);
+	if (ret) {
+		solo_enc->priority = old_priority;
+		solo_enc->max_interval = old_interval;
+	}
+
+	mutex_unlock(&solo_dev->enc_sched_lock);
+
+	return ret;
+}
+
+/* Ranges are checked by the control framework before we get here */
+static int solo_enc_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct solo_enc_dev *solo_enc =
+		container_of(ctrl->handler, struct solo_enc_dev, hdl);
+	struct solo_dev *solo_dev = solo_enc->solo_dev;
+	int ret;
 
 	switch (ctrl->id) {
 	case V4L2_CID_BRIGHTNESS:
@@ -1514,20 +3021,25 @@ static int solo_s_ctrl(struct file *file, void *priv,
 	case V4L2_CID_HUE:
 	case V4L2_CID_SHARPNESS:
 		return tw28_set_ctrl_val(solo_dev, ctrl->id, solo_enc->ch,
-					 ctrl->value);
+					 ctrl->val);
 	case V4L2_CID_MPEG_VIDEO_ENCODING:
-		if (ctrl->value != V4L2_MPEG_VIDEO_ENCODING_MPEG_4_AVC)
-			return -ERANGE;
-		break;
+		return 0;
 	case V4L2_CID_MPEG_VIDEO_GOP_SIZE:
-		if (ctrl->value < 1 || ctrl->value > 255)
-			return -ERANGE;
-		solo_enc->gop = ctrl->value;
-		break;
+		mutex_lock(&solo_enc->enable_lock);
+		solo_enc->gop = ctrl->val;
+		solo_enc_reconf_later(solo_enc);
+		mutex_unlock(&solo_enc->enable_lock);
+		return 0;
+	case V4L2_CID_ENC_QP:
+		mutex_lock(&solo_enc->enable_lock);
+		solo_enc->qp = ctrl->val;
+		solo_enc_reconf_later(solo_enc);
+		mutex_unlock(&solo_enc->enable_lock);
+		return 0;
 	case V4L2_CID_MOTION_THRESHOLD:
 	{
-		u16 block = (ctrl->value >> 16) & 0xffff;
-		u16 value = ctrl->value & 0xffff;
+		u16 block = (ctrl->val >> 16) & 0xffff;
+		u16 value = ctrl->val & 0xffff;
 
 		/* Motion thresholds are in a table of 64x64 samples, with
 		 * each sample representing 16x16 pixels of the source. In
@@ -1536,111 +3048,148 @@ static int solo_s_ctrl(struct file *file, void *priv,
 		 *
 		 * Block is 0 to set the threshold globally, or any positive
 		 * number under 2049 to set block-1 individually. */
-		if (block > 2049)
-			return -ERANGE;
-
 		if (block == 0) {
 			solo_enc->motion_thresh = value;
 			return solo_set_motion_threshold(solo_dev,
 							 solo_enc->ch, value);
-		} else {
-			return solo_set_motion_block(solo_dev, solo_enc->ch,
-						     value, block - 1);
 		}
-		break;
+
+		return solo_set_motion_block(solo_dev, solo_enc->ch, value,
+					     block - 1);
 	}
 	case V4L2_CID_MOTION_ENABLE:
-		solo_motion_toggle(solo_enc, ctrl->value);
-		break;
-	default:
-		return -EINVAL;
+		solo_motion_toggle(solo_enc, ctrl->val);
+		return 0;
+	case V4L2_CID_MOTION_GATE:
+		mutex_lock(&solo_enc->enable_lock);
+		solo_enc->gate_hold = ctrl->val;
+		solo_enc->gate_motion = 0;
+		mutex_unlock(&solo_enc->enable_lock);
+		return 0;
+	case V4L2_CID_ENC_PRIORITY:
+	case V4L2_CID_ENC_MAX_INTERVAL:
+		return solo_enc_sched_ctrl(solo_enc, ctrl->id, ctrl->val);
+	case V4L2_CID_RDS_TX_RADIO_TEXT:
+		mutex_lock(&solo_enc->enable_lock);
+		strscpy(solo_enc->osd_text, ctrl->p_new.p_char,
+			sizeof(solo_enc->osd_text));
+		ret = solo_osd_print(solo_enc);
+		mutex_unlock(&solo_enc->enable_lock);
+		return ret;
 	}
 
-	return 0;
+	return -EINVAL;
 }
 
-static int solo_s_ext_ctrls(struct file *file, void *priv,
-			    struct v4l2_ext_controls *ctrls)
-{
-	struct solo_enc_fh *fh = priv;
-	struct solo_enc_dev *solo_enc = fh->enc;
-	int i;
-
-	for (i = 0; i < ctrls->count; i++) {
-		struct v4l2_ext_control *ctrl = (ctrls->controls + i);
-		int err;
-
-		switch (ctrl->id) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
-		case V4L2_CID_RDS_TX_RADIO_TEXT:
-			if (ctrl->size - 1 > OSD_TEXT_MAX)
-				err = -ERANGE;
-			else {
-				mutex_lock(&solo_enc->enable_lock);
-				err = copy_from_user(solo_enc->osd_text,
-						     ctrl->string,
-						     OSD_TEXT_MAX);
-				solo_enc->osd_text[OSD_TEXT_MAX] = '\0';
-				if (!err)
-					err = solo_osd_print(solo_enc);
-				else
-					err = -EFAULT;
-				mutex_unlock(&solo_enc->enable_lock);
-			}
-			break;
-#endif
-		default:
-			err = -EINVAL;
-		}
+static const struct v4l2_ctrl_ops solo_enc_ctrl_ops = {
+	.g_volatile_ctrl	= solo_enc_g_volatile_ctrl,
+	.s_ctrl			= solo_enc_s_ctrl,
+};
 
-		if (err < 0) {
-			ctrls->error_idx = i;
-			return err;
-		}
-	}
+/* The tw28xx picture controls, read back from the chip */
+static const struct {
+	u32	id;
+	s32	max;
+	s32	def;
+} solo_enc_tw28_ctrls[] = {
+	{ V4L2_CID_BRIGHTNESS,	0xff,	0x80 },
+	{ V4L2_CID_CONTRAST,	0xff,	0x80 },
+	{ V4L2_CID_SATURATION,	0xff,	0x80 },
+	{ V4L2_CID_HUE,		0xff,	0x80 },
+	{ V4L2_CID_SHARPNESS,	0x0f,	0x00 },
+};
 
-	return 0;
-}
+/* In order of ID, see solo_ctrl_new_placeholder() */
+static const struct v4l2_ctrl_config solo_enc_custom_ctrls[] = {
+	{
+		.ops	= &solo_enc_ctrl_ops,
+		.id	= V4L2_CID_MOTION_ENABLE,
+		.name	= "Motion Detection Enable",
+		.type	= V4L2_CTRL_TYPE_BOOLEAN,
+		.max	= 1,
+		.step	= 1,
+	}, {
+		/* The block to set goes in the upper 16 bits, and the
+		 * global threshold is what reads back */
+		.ops	= &solo_enc_ctrl_ops,
+		.id	= V4L2_CID_MOTION_THRESHOLD,
+		.name	= "Motion Detection Threshold",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.max	= (2049 << 16) | 0xffff,
+		.step	= 1,
+		.def	= SOLO_DEF_MOT_THRESH,
+		.flags	= V4L2_CTRL_FLAG_SLIDER | V4L2_CTRL_FLAG_VOLATILE |
+			  V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+	}, {
+		.ops	= &solo_enc_ctrl_ops,
+		.id	= V4L2_CID_MOTION_GATE,
+		.name	= "Motion Gate Hold Time",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.max	= SOLO_MOTION_GATE_MAX,
+		.step	= 1,
+	}, {
+		.ops	= &solo_enc_ctrl_ops,
+		.id	= V4L2_CID_ENC_PRIORITY,
+		.name	= "Encoder Priority",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.max	= SOLO_ENC_PRIORITY_MAX,
+		.step	= 1,
+		.def	= SOLO_ENC_PRIORITY_DEF,
+	}, {
+		.ops	= &solo_enc_ctrl_ops,
+		.id	= V4L2_CID_ENC_MAX_INTERVAL,
+		.name	= "Encoder Max Frame Interval",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.min	= 1,
+		.max	= SOLO_ENC_INTERVAL_MAX,
+		.step	= 1,
+		.def	= SOLO_ENC_INTERVAL_MAX,
+	}, {
+		.ops	= &solo_enc_ctrl_ops,
+		.id	= V4L2_CID_ENC_QP,
+		.name	= "Encoder Quantizer",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.max	= SOLO_ENC_QP_MAX,
+		.step	= 1,
+		.def	= SOLO_DEFAULT_QP,
+	},
+};
 
-static int solo_g_ext_ctrls(struct file *file, void *priv,
-			    struct v4l2_ext_controls *ctrls)
+/* Nothing is pushed to the hardware here, the defaults match what
+ * solo_enc_alloc() and the tw28xx setup leave behind */
+static int solo_enc_ctrls_init(struct solo_enc_dev *solo_enc)
 {
-	struct solo_enc_fh *fh = priv;
-	struct solo_enc_dev *solo_enc = fh->enc;
+	struct v4l2_ctrl_handler *hdl = &solo_enc->hdl;
+	const struct v4l2_ctrl_ops *ops = &solo_enc_ctrl_ops;
+	struct v4l2_ctrl *ctrl;
 	int i;
 
-	for (i = 0; i < ctrls->count; i++) {
-		struct v4l2_ext_control *ctrl = (ctrls->controls + i);
-		int err;
-
-		switch (ctrl->id) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
-		case V4L2_CID_RDS_TX_RADIO_TEXT:
-			if (ctrl->size < OSD_TEXT_MAX) {
-				ctrl->size = OSD_TEXT_MAX;
-				err = -ENOSPC;
-			} else {
-				mutex_lock(&solo_enc->enable_lock);
-				err = copy_to_user(ctrl->string,
-						   solo_enc->osd_text,
-						   OSD_TEXT_MAX);
-				if (err)
-					err = -EFAULT;
-				mutex_unlock(&solo_enc->enable_lock);
-			}
-			break;
-#endif
-		default:
-			err = -EINVAL;
-		}
+	v4l2_ctrl_handler_init(hdl, ARRAY_SIZE(solo_enc_tw28_ctrls) +
+			       ARRAY_SIZE(solo_enc_custom_ctrls) + 4);
 
-		if (err < 0) {
-			ctrls->error_idx = i;
-			return err;
-		}
+	for (i = 0; i < ARRAY_SIZE(solo_enc_tw28_ctrls); i++) {
+		ctrl = v4l2_ctrl_new_std(hdl, ops, solo_enc_tw28_ctrls[i].id,
+					 0, solo_enc_tw28_ctrls[i].max, 1,
+					 solo_enc_tw28_ctrls[i].def);
+		if (ctrl)
+			ctrl->flags |= V4L2_CTRL_FLAG_VOLATILE |
+				       V4L2_CTRL_FLAG_EXECUTE_ON_WRITE;
 	}
 
-	return 0;
+	v4l2_ctrl_new_std_menu(hdl, ops, V4L2_CID_MPEG_VIDEO_ENCODING,
+			       V4L2_MPEG_VIDEO_ENCODING_MPEG_4_AVC,
+			       ~(1 << V4L2_MPEG_VIDEO_ENCODING_MPEG_4_AVC),
+			       V4L2_MPEG_VIDEO_ENCODING_MPEG_4_AVC);
+	v4l2_ctrl_new_std(hdl, ops, V4L2_CID_MPEG_VIDEO_GOP_SIZE, 1, 255, 1,
+			  solo_enc->solo_dev->fps);
+	v4l2_ctrl_new_std(hdl, ops, V4L2_CID_RDS_TX_RADIO_TEXT, 0,
+			  OSD_TEXT_MAX, 1, 0);
+
+	for (i = 0; i < ARRAY_SIZE(solo_enc_custom_ctrls); i++)
+		v4l2_ctrl_new_custom(hdl, &solo_enc_custom_ctrls[i], NULL);
+	solo_ctrl_new_placeholder(hdl, V4L2_CID_MOTION_TRACE);
+
+	return hdl->error;
 }
 
 static const struct v4l2_file_operations solo_enc_fops = {
@@ -1650,11 +3199,12 @@ static const struct v4l2_file_operations solo_enc_fops = {
 	.read			= solo_enc_read,
 	.poll			= solo_enc_poll,
 	.mmap			= solo_enc_mmap,
-	.ioctl			= video_ioctl2,
+	.unlocked_ioctl		= video_ioctl2,
 };
 
 static const struct v4l2_ioctl_ops solo_enc_ioctl_ops = {
 	.vidioc_querycap		= solo_enc_querycap,
+	.vidioc_g_std			= solo_enc_g_std,
 	.vidioc_s_std			= solo_enc_s_std,
 	/* Input callbacks */
 	.vidioc_enum_input		= solo_enc_enum_input,
@@ -1670,8 +3220,11 @@ static const struct v4l2_ioctl_ops solo_enc_ioctl_ops = {
 	.vidioc_querybuf		= solo_enc_querybuf,
 	.vidioc_qbuf			= solo_enc_qbuf,
 	.vidioc_dqbuf			= solo_enc_dqbuf,
+	.vidioc_expbuf			= solo_enc_expbuf,
 	.vidioc_streamon		= solo_enc_streamon,
 	.vidioc_streamoff		= solo_enc_streamoff,
+	/* Bitstream ring */
+	.vidioc_default			= solo_enc_default,
 	/* Frame size and interval */
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 31)
 	.vidioc_enum_framesizes		= solo_enum_framesizes,
@@ -1680,13 +3233,6 @@ static const struct v4l2_ioctl_ops solo_enc_ioctl_ops = {
 	/* Video capture parameters */
 	.vidioc_s_parm			= solo_s_parm,
 	.vidioc_g_parm			= solo_g_parm,
-	/* Controls */
-	.vidioc_queryctrl		= solo_queryctrl,
-	.vidioc_querymenu		= solo_querymenu,
-	.vidioc_g_ctrl			= solo_g_ctrl,
-	.vidioc_s_ctrl			= solo_s_ctrl,
-	.vidioc_g_ext_ctrls		= solo_g_ext_ctrls,
-	.vidioc_s_ext_ctrls		= solo_s_ext_ctrls,
 };
 
 static const struct video_device solo_enc_template = {
@@ -1695,11 +3241,181 @@ static const struct video_device solo_enc_template = {
 	.ioctl_ops		= &solo_enc_ioctl_ops,
 	.minor			= -1,
 	.release		= video_device_release,
+	.device_caps		= V4L2_CAP_VIDEO_CAPTURE |
+				  V4L2_CAP_READWRITE |
+				  V4L2_CAP_STREAMING,
+
+	.tvnorms		= V4L2_STD_NTSC_M | V4L2_STD_PAL_B,
+};
+
+static int solo_enc_mux_querycap(struct file *file, void  *priv,
+				 struct v4l2_capability *cap)
+{
+	struct solo_enc_fh *fh = priv;
+	struct solo_dev *solo_dev = fh->solo_dev;
+
+	strcpy(cap->driver, SOLO6X10_NAME);
+	strcpy(cap->card, "Softlogic 6x10 Enc Mux");
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "PCI %s",
+		 pci_name(solo_dev->pdev));
+	cap->version = SOLO6X10_VER_NUM;
+	cap->device_caps = video_devdata(file)->device_caps;
+	cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+	return 0;
+}
+
+static int solo_enc_mux_enum_input(struct file *file, void *priv,
+				   struct v4l2_input *input)
+{
+	struct solo_enc_fh *fh = priv;
+	struct solo_dev *solo_dev = fh->solo_dev;
+
+	if (input->index)
+		return -EINVAL;
+
+	snprintf(input->name, sizeof(input->name), "All encoders");
+	input->type = V4L2_INPUT_TYPE_CAMERA;
+
+	if (solo_dev->video_type == SOLO_VO_FMT_TYPE_NTSC)
+		input->std = V4L2_STD_NTSC_M;
+	else
+		input->std = V4L2_STD_PAL_B;
+
+	return 0;
+}
+
+/* Channels keep their own resolution, so only the largest one can be
+ * reported here */
+static int solo_enc_mux_try_fmt_cap(struct file *file, void *priv,
+				    struct v4l2_format *f)
+{
+	struct solo_enc_fh *fh = priv;
+	struct solo_dev *solo_dev = fh->solo_dev;
+	struct v4l2_pix_format *pix = &f->fmt.pix;
+
+	if (pix->pixelformat != V4L2_PIX_FMT_MPEG &&
+	    pix->pixelformat != V4L2_PIX_FMT_MJPEG)
+		return -EINVAL;
+
+	pix->width = solo_dev->video_hsize;
+	pix->height = solo_dev->video_vsize << 1;
+	pix->field = V4L2_FIELD_INTERLACED;
+	pix->colorspace = V4L2_COLORSPACE_SMPTE170M;
+	pix->sizeimage = FRAME_BUF_SIZE;
+
+	return 0;
+}
+
+static int solo_enc_mux_set_fmt_cap(struct file *file, void *priv,
+				    struct v4l2_format *f)
+{
+	struct solo_enc_fh *fh = priv;
+	struct v4l2_pix_format *pix = &f->fmt.pix;
+	int ret;
+
+	ret = solo_enc_mux_try_fmt_cap(file, priv, f);
+	if (ret)
+		return ret;
+
+	mutex_lock(&fh->lock);
+	if (vb2_is_busy(&fh->vidq)) {
+		mutex_unlock(&fh->lock);
+		return -EBUSY;
+	}
+
+	fh->fmt = pix->pixelformat;
+	fh->type = pix->priv ? SOLO_ENC_TYPE_EXT : SOLO_ENC_TYPE_STD;
+	mutex_unlock(&fh->lock);
+
+	return 0;
+}
+
+static int solo_enc_mux_get_fmt_cap(struct file *file, void *priv,
+				    struct v4l2_format *f)
+{
+	struct solo_enc_fh *fh = priv;
+	struct v4l2_pix_format *pix = &f->fmt.pix;
+
+	pix->pixelformat = fh->fmt;
+
+	return solo_enc_mux_try_fmt_cap(file, priv, f);
+}
+
+static const struct v4l2_file_operations solo_enc_mux_fops = {
+	.owner			= THIS_MODULE,
+	.open			= solo_enc_mux_open,
+	.release		= solo_enc_release,
+	.read			= solo_enc_read,
+	.poll			= solo_enc_poll,
+	.mmap			= solo_enc_mmap,
+	.unlocked_ioctl		= video_ioctl2,
+};
+
+static const struct v4l2_ioctl_ops solo_enc_mux_ioctl_ops = {
+	.vidioc_querycap		= solo_enc_mux_querycap,
+	.vidioc_g_std			= solo_enc_g_std,
+	.vidioc_s_std			= solo_enc_s_std,
+	/* Input callbacks */
+	.vidioc_enum_input		= solo_enc_mux_enum_input,
+	.vidioc_s_input			= solo_enc_set_input,
+	.vidioc_g_input			= solo_enc_get_input,
+	/* Video capture format callbacks */
+	.vidioc_enum_fmt_vid_cap	= solo_enc_enum_fmt_cap,
+	.vidioc_try_fmt_vid_cap		= solo_enc_mux_try_fmt_cap,
+	.vidioc_s_fmt_vid_cap		= solo_enc_mux_set_fmt_cap,
+	.vidioc_g_fmt_vid_cap		= solo_enc_mux_get_fmt_cap,
+	/* Streaming I/O */
+	.vidioc_reqbufs			= solo_enc_reqbufs,
+	.vidioc_querybuf		= solo_enc_querybuf,
+	.vidioc_qbuf			= solo_enc_qbuf,
+	.vidioc_dqbuf			= solo_enc_dqbuf,
+	.vidioc_expbuf			= solo_enc_expbuf,
+	.vidioc_streamon		= solo_enc_streamon,
+	.vidioc_streamoff		= solo_enc_streamoff,
+	/* Bitstream ring */
+	.vidioc_default			= solo_enc_default,
+};
+
+static const struct video_device solo_enc_mux_template = {
+	.name			= SOLO6X10_NAME,
+	.fops			= &solo_enc_mux_fops,
+	.ioctl_ops		= &solo_enc_mux_ioctl_ops,
+	.minor			= -1,
+	.release		= video_device_release,
+	.device_caps		= V4L2_CAP_VIDEO_CAPTURE |
+				  V4L2_CAP_READWRITE |
+				  V4L2_CAP_STREAMING,
 
 	.tvnorms		= V4L2_STD_NTSC_M | V4L2_STD_PAL_B,
-	.current_norm		= V4L2_STD_NTSC_M,
 };
 
+static int solo_enc_mux_alloc(struct solo_dev *solo_dev, unsigned nr)
+{
+	struct video_device *vfd;
+	int ret;
+
+	vfd = video_device_alloc();
+	if (!vfd)
+		return -ENOMEM;
+
+	*vfd = solo_enc_mux_template;
+	vfd->v4l2_dev = &solo_dev->v4l2_dev;
+	ret = video_register_device(vfd, VFL_TYPE_VIDEO, nr);
+	if (ret < 0) {
+		video_device_release(vfd);
+		return ret;
+	}
+
+	video_set_drvdata(vfd, solo_dev);
+
+	snprintf(vfd->name, sizeof(vfd->name), "%s-enc-mux (%i/%i)",
+		 SOLO6X10_NAME, solo_dev->vfd->num, vfd->num);
+
+	solo_dev->enc_mux_vfd = vfd;
+
+	return 0;
+}
+
 static struct solo_enc_dev *solo_enc_alloc(struct solo_dev *solo_dev,
 					   u8 ch, unsigned nr)
 {
@@ -1718,15 +3434,22 @@ static struct solo_enc_dev *solo_enc_alloc(struct solo_dev *solo_dev,
 
 	solo_enc->solo_dev = solo_dev;
 	solo_enc->ch = ch;
+	solo_enc->desc = solo_dev->enc_desc + ch * SOLO_ENC_NR_DESC;
+
+	ret = solo_enc_fanout_alloc(solo_enc);
+	if (ret)
+		goto fail_fanout;
+
+	ret = solo_enc_ctrls_init(solo_enc);
+	if (ret)
+		goto fail_ctrls;
 
 	*solo_enc->vfd = solo_enc_template;
-	solo_enc->vfd->parent = &solo_dev->pdev->dev;
-	ret = video_register_device(solo_enc->vfd, VFL_TYPE_GRABBER, nr);
-	if (ret < 0) {
-		video_device_release(solo_enc->vfd);
-		kfree(solo_enc);
-		return ERR_PTR(ret);
-	}
+	solo_enc->vfd->v4l2_dev = &solo_dev->v4l2_dev;
+	solo_enc->vfd->ctrl_handler = &solo_enc->hdl;
+	ret = video_register_device(solo_enc->vfd, VFL_TYPE_VIDEO, nr);
+	if (ret < 0)
+		goto fail_ctrls;
 
 	video_set_drvdata(solo_enc->vfd, solo_enc);
 
@@ -1735,8 +3458,12 @@ static struct solo_enc_dev *solo_enc_alloc(struct solo_dev *solo_dev,
 		 solo_enc->vfd->num);
 
 	INIT_LIST_HEAD(&solo_enc->listeners);
+	INIT_LIST_HEAD(&solo_enc->gop[SOLO_ENC_TYPE_STD].frames);
+	INIT_LIST_HEAD(&solo_enc->gop[SOLO_ENC_TYPE_EXT].frames);
 	mutex_init(&solo_enc->enable_lock);
 	spin_lock_init(&solo_enc->motion_lock);
+	spin_lock_init(&solo_enc->frame_lock);
+	INIT_WORK(&solo_enc->work, solo_enc_work);
 
 	atomic_set(&solo_enc->readers, 0);
 	atomic_set(&solo_enc->mpeg_readers, 0);
@@ -1744,6 +3471,9 @@ static struct solo_enc_dev *solo_enc_alloc(struct solo_dev *solo_dev,
 	solo_enc->qp = SOLO_DEFAULT_QP;
 	solo_enc->gop = solo_dev->fps;
 	solo_enc->interval = 1;
+	solo_enc->sched_interval = 1;
+	solo_enc->max_interval = SOLO_ENC_INTERVAL_MAX;
+	solo_enc->priority = SOLO_ENC_PRIORITY_DEF;
 	solo_enc->mode = SOLO_ENC_MODE_CIF;
 	solo_enc->motion_thresh = SOLO_DEF_MOT_THRESH;
 
@@ -1756,6 +3486,14 @@ static struct solo_enc_dev *solo_enc_alloc(struct solo_dev *solo_dev,
 	memcpy(solo_enc->jpeg_header, jpeg_header, solo_enc->jpeg_len);
 
 	return solo_enc;
+
+fail_ctrls:
+	v4l2_ctrl_handler_free(&solo_enc->hdl);
+	solo_enc_fanout_free(solo_enc);
+fail_fanout:
+	video_device_release(solo_enc->vfd);
+	kfree(solo_enc);
+	return ERR_PTR(ret);
 }
 
 static void solo_enc_free(struct solo_enc_dev *solo_enc)
@@ -1763,18 +3501,95 @@ static void solo_enc_free(struct solo_enc_dev *solo_enc)
 	if (solo_enc == NULL)
 		return;
 
+	solo_enc_fanout_free(solo_enc);
+	solo_enc_gop_clear(&solo_enc->gop[SOLO_ENC_TYPE_STD]);
+	solo_enc_gop_clear(&solo_enc->gop[SOLO_ENC_TYPE_EXT]);
+
 	video_unregister_device(solo_enc->vfd);
+	v4l2_ctrl_handler_free(&solo_enc->hdl);
 	kfree(solo_enc);
 }
 
+/* For the enc_drops sysfs attribute */
+ssize_t solo_enc_drops_show(struct solo_dev *solo_dev, char *buf)
+{
+	static const char * const why[SOLO_ENC_NR_DROPS] = {
+		[SOLO_ENC_DROP_HEADER]		= "header",
+		[SOLO_ENC_DROP_QUEUE]		= "queue",
+		[SOLO_ENC_DROP_OVERWRITE]	= "overwrite",
+		[SOLO_ENC_DROP_NOBUF]		= "nobuf",
+	};
+	size_t len = 0;
+	int i, j;
+
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			 "hw_queue_overruns: %d\nheader_dma_errors: %d\n",
+			 atomic_read(&solo_dev->enc_hw_overruns),
+			 atomic_read(&solo_dev->enc_hdr_errors));
+
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		struct solo_enc_dev *solo_enc = solo_dev->v4l2_enc[i];
+		struct solo_enc_fh *fh;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%2d:", i);
+		for (j = 0; j < SOLO_ENC_NR_DROPS; j++)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 " %s %d", why[j],
+					 atomic_read(&solo_enc->drops[j]));
+
+		/* Then what each current listener missed */
+		mutex_lock(&solo_enc->enable_lock);
+		list_for_each_entry(fh, &solo_enc->listeners, list)
+			len += scnprintf(buf + len, PAGE_SIZE - len, " [%d]",
+					 atomic_read(&fh->drops));
+		mutex_unlock(&solo_enc->enable_lock);
+
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+
+	return len;
+}
+
+/* On failure, whatever was set up is left for solo_enc_v4l2_exit(),
+ * which probe gets to through free_solo_dev() */
 int solo_enc_v4l2_init(struct solo_dev *solo_dev, unsigned nr)
 {
+	int ret;
 	int i;
 
 	atomic_set(&solo_dev->enc_users, 0);
+	atomic_set(&solo_dev->enc_hw_overruns, 0);
+	atomic_set(&solo_dev->enc_hdr_errors, 0);
+	atomic64_set(&solo_dev->enc_ring_pos, 0);
 	init_waitqueue_head(&solo_dev->ring_thread_wait);
+	mutex_init(&solo_dev->enc_mux_lock);
+	mutex_init(&solo_dev->enc_sched_lock);
+	INIT_LIST_HEAD(&solo_dev->enc_mux_listeners);
+
+	/* Set before any node is registered, a stream may start right away */
+	if (solo_dev->type == SOLO_DEV_6010)
+		solo_dev->enc_bw = solo_dev->fps * 4 * 4;
+	else
+		solo_dev->enc_bw = solo_dev->fps * 4 * 5;
 
-	solo_dev->vh_size = sizeof(struct vop_header);
+	/* One work item per channel, which may run on any CPU */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	solo_dev->enc_wq = alloc_workqueue(SOLO6X10_NAME "_enc", WQ_UNBOUND,
+					   solo_dev->nr_chans);
+#else
+	solo_dev->enc_wq = create_workqueue(SOLO6X10_NAME "_enc");
+#endif
+	if (solo_dev->enc_wq == NULL)
+		return -ENOMEM;
+
+	/* Descriptors are copied into the engine's own ring on submit, so
+	 * this needn't be coherent memory */
+	solo_dev->enc_desc = kcalloc(solo_dev->nr_chans * SOLO_ENC_NR_DESC,
+				     sizeof(struct solo_p2m_desc), GFP_KERNEL);
+	if (solo_dev->enc_desc == NULL)
+		return -ENOMEM;
+
+	solo_dev->vh_size = sizeof(struct vop_header) * MP4_QS;
 	solo_dev->vh_buf = pci_alloc_consistent(solo_dev->pdev,
 						solo_dev->vh_size,
 						&solo_dev->vh_dma);
@@ -1782,28 +3597,23 @@ int solo_enc_v4l2_init(struct solo_dev *solo_dev, unsigned nr)
 		return -ENOMEM;
 
 	for (i = 0; i < solo_dev->nr_chans; i++) {
-		solo_dev->v4l2_enc[i] = solo_enc_alloc(solo_dev, i, nr);
-		if (IS_ERR(solo_dev->v4l2_enc[i]))
-			break;
-	}
+		struct solo_enc_dev *solo_enc = solo_enc_alloc(solo_dev, i, nr);
 
-	if (i != solo_dev->nr_chans) {
-		int ret = PTR_ERR(solo_dev->v4l2_enc[i]);
-		while (i--)
-			solo_enc_free(solo_dev->v4l2_enc[i]);
-		pci_free_consistent(solo_dev->pdev, solo_dev->vh_size,
-				    solo_dev->vh_buf, solo_dev->vh_dma);
-		return ret;
+		if (IS_ERR(solo_enc))
+			return PTR_ERR(solo_enc);
+
+		solo_dev->v4l2_enc[i] = solo_enc;
 	}
 
-	if (solo_dev->type == SOLO_DEV_6010)
-		solo_dev->enc_bw_remain = solo_dev->fps * 4 * 4;
-	else
-		solo_dev->enc_bw_remain = solo_dev->fps * 4 * 5;
+	ret = solo_enc_mux_alloc(solo_dev, nr);
+	if (ret)
+		return ret;
 
 	dev_info(&solo_dev->pdev->dev, "Encoders as /dev/video%d-%d\n",
 		 solo_dev->v4l2_enc[0]->vfd->num,
 		 solo_dev->v4l2_enc[solo_dev->nr_chans - 1]->vfd->num);
+	dev_info(&solo_dev->pdev->dev, "All-channel encoder as /dev/video%d\n",
+		 solo_dev->enc_mux_vfd->num);
 
 	return 0;
 }
@@ -1812,9 +3622,39 @@ void solo_enc_v4l2_exit(struct solo_dev *solo_dev)
 {
 	int i;
 
-	for (i = 0; i < solo_dev->nr_chans; i++)
+	if (solo_dev->enc_mux_vfd) {
+		video_unregister_device(solo_dev->enc_mux_vfd);
+		solo_dev->enc_mux_vfd = NULL;
+	}
+
+	for (i = 0; i < solo_dev->nr_chans; i++) {
+		struct solo_enc_dev *solo_enc = solo_dev->v4l2_enc[i];
+
+		if (solo_enc == NULL)
+			continue;
+
+		if (solo_enc->preroll[SOLO_ENC_TYPE_STD])
+			solo_enc_preroll_set(solo_enc, SOLO_ENC_TYPE_STD, 0);
+		if (solo_enc->preroll[SOLO_ENC_TYPE_EXT])
+			solo_enc_preroll_set(solo_enc, SOLO_ENC_TYPE_EXT, 0);
+	}
+
+	for (i = 0; i < solo_dev->nr_chans; i++) {
 		solo_enc_free(solo_dev->v4l2_enc[i]);
+		solo_dev->v4l2_enc[i] = NULL;
+	}
+
+	if (solo_dev->vh_buf) {
+		pci_free_consistent(solo_dev->pdev, solo_dev->vh_size,
+				    solo_dev->vh_buf, solo_dev->vh_dma);
+		solo_dev->vh_buf = NULL;
+	}
 
-	pci_free_consistent(solo_dev->pdev, solo_dev->vh_size,
-			    solo_dev->vh_buf, solo_dev->vh_dma);
+	kfree(solo_dev->enc_desc);
+	solo_dev->enc_desc = NULL;
+
+	if (solo_dev->enc_wq) {
+		destroy_workqueue(solo_dev->enc_wq);
+		solo_dev->enc_wq = NULL;
+	}
 }
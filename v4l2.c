@@ -33,6 +33,7 @@
 
 #include "solo6x10.h"
 #include "tw28.h"
+#include "compat.h"
 
 #define SOLO_DISP_PIX_FIELD	V4L2_FIELD_INTERLACED
 
@@ -227,7 +228,8 @@ static void solo_fillbuf(struct solo_filehandle *fh,
 		fdma_addr = SOLO_DISP_EXT_ADDR + (fh->old_write *
 				(SOLO_HW_BPL * solo_vlines(solo_dev)));
 
-		error = solo_p2m_dma_t(solo_dev, 0, vbuf, fdma_addr,
+		error = solo_p2m_dma_t(solo_dev, SOLO_P2M_CALLER_DISPLAY, 0,
+				       vbuf, fdma_addr,
 				       solo_bytesperline(solo_dev),
 				       solo_vlines(solo_dev), SOLO_HW_BPL);
 	}
@@ -496,9 +498,8 @@ static int solo_querycap(struct file *file, void  *priv,
 	snprintf(cap->bus_info, sizeof(cap->bus_info), "PCI %s",
 		 pci_name(solo_dev->pdev));
 	cap->version = SOLO6X10_VER_NUM;
-	cap->capabilities =     V4L2_CAP_VIDEO_CAPTURE |
-				V4L2_CAP_READWRITE |
-				V4L2_CAP_STREAMING;
+	cap->device_caps = video_devdata(file)->device_caps;
+	cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
 	return 0;
 }
 
@@ -700,69 +701,45 @@ static int solo_streamoff(struct file *file, void *priv, enum v4l2_buf_type i)
 	return videobuf_streamoff(&fh->vidq);
 }
 
-static int solo_s_std(struct file *file, void *priv, v4l2_std_id *i)
+static int solo_g_std(struct file *file, void *priv, v4l2_std_id *i)
 {
-	return 0;
-}
+	struct solo_filehandle *fh = priv;
 
-static const u32 solo_motion_ctrls[] = {
-	V4L2_CID_MOTION_TRACE,
-	0
-};
+	if (fh->solo_dev->video_type == SOLO_VO_FMT_TYPE_NTSC)
+		*i = V4L2_STD_NTSC_M;
+	else
+		*i = V4L2_STD_PAL_B;
 
-static const u32 *solo_ctrl_classes[] = {
-	solo_motion_ctrls,
-	NULL
-};
+	return 0;
+}
 
-static int solo_disp_queryctrl(struct file *file, void *priv,
-			       struct v4l2_queryctrl *qc)
+static int solo_s_std(struct file *file, void *priv, v4l2_std_id i)
 {
-	qc->id = v4l2_ctrl_next(solo_ctrl_classes, qc->id);
-	if (!qc->id)
-		return -EINVAL;
-
-	switch (qc->id) {
-#ifdef PRIVATE_CIDS
-	case V4L2_CID_MOTION_TRACE:
-		qc->type = V4L2_CTRL_TYPE_BOOLEAN;
-		qc->minimum = 0;
-		qc->maximum = qc->step = 1;
-		qc->default_value = 0;
-		strlcpy(qc->name, "Motion Detection Trace", sizeof(qc->name));
-		return 0;
-#else
-	case V4L2_CID_MOTION_TRACE:
-		return v4l2_ctrl_query_fill(qc, 0, 1, 1, 0);
-#endif
-	}
-	return -EINVAL;
+	return 0;
 }
 
-static int solo_disp_g_ctrl(struct file *file, void *priv,
-			    struct v4l2_control *ctrl)
+static int solo_disp_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
 {
-	struct solo_filehandle *fh = priv;
-	struct solo_dev *solo_dev = fh->solo_dev;
+	struct solo_dev *solo_dev =
+		container_of(ctrl->handler, struct solo_dev, disp_hdl);
 
 	switch (ctrl->id) {
 	case V4L2_CID_MOTION_TRACE:
-		ctrl->value = solo_reg_read(solo_dev, SOLO_VI_MOTION_BAR)
+		ctrl->val = solo_reg_read(solo_dev, SOLO_VI_MOTION_BAR)
 			? 1 : 0;
 		return 0;
 	}
 	return -EINVAL;
 }
 
-static int solo_disp_s_ctrl(struct file *file, void *priv,
-			    struct v4l2_control *ctrl)
+static int solo_disp_s_ctrl(struct v4l2_ctrl *ctrl)
 {
-	struct solo_filehandle *fh = priv;
-	struct solo_dev *solo_dev = fh->solo_dev;
+	struct solo_dev *solo_dev =
+		container_of(ctrl->handler, struct solo_dev, disp_hdl);
 
 	switch (ctrl->id) {
 	case V4L2_CID_MOTION_TRACE:
-		if (ctrl->value) {
+		if (ctrl->val) {
 			solo_reg_write(solo_dev, SOLO_VI_MOTION_BORDER,
 					SOLO_VI_MOTION_Y_ADD |
 					SOLO_VI_MOTION_Y_VALUE(0x20) |
@@ -782,6 +759,39 @@ static int solo_disp_s_ctrl(struct file *file, void *priv,
 	return -EINVAL;
 }
 
+static const struct v4l2_ctrl_ops solo_disp_ctrl_ops = {
+	.g_volatile_ctrl	= solo_disp_g_volatile_ctrl,
+	.s_ctrl			= solo_disp_s_ctrl,
+};
+
+/* Read back from the hardware, and written even when unchanged */
+static const struct v4l2_ctrl_config solo_motion_trace_ctrl = {
+	.ops			= &solo_disp_ctrl_ops,
+	.id			= V4L2_CID_MOTION_TRACE,
+	.name			= "Motion Detection Trace",
+	.type			= V4L2_CTRL_TYPE_BOOLEAN,
+	.max			= 1,
+	.step			= 1,
+	.flags			= V4L2_CTRL_FLAG_VOLATILE |
+				  V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+};
+
+/* Takes up the slot of a driver control this node doesn't have, so
+ * that V4L2_CID_PRIVATE_BASE + n still finds the n-th one. */
+void solo_ctrl_new_placeholder(struct v4l2_ctrl_handler *hdl, u32 id)
+{
+	struct v4l2_ctrl_config cfg = {
+		.id		= id,
+		.name		= "Unused",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.flags		= V4L2_CTRL_FLAG_DISABLED |
+				  V4L2_CTRL_FLAG_READ_ONLY,
+	};
+
+	v4l2_ctrl_new_custom(hdl, &cfg, NULL);
+}
+
 static const struct v4l2_file_operations solo_v4l2_fops = {
 	.owner			= THIS_MODULE,
 	.open			= solo_v4l2_open,
@@ -789,11 +799,12 @@ static const struct v4l2_file_operations solo_v4l2_fops = {
 	.read			= solo_v4l2_read,
 	.poll			= solo_v4l2_poll,
 	.mmap			= solo_v4l2_mmap,
-	.ioctl			= video_ioctl2,
+	.unlocked_ioctl		= video_ioctl2,
 };
 
 static const struct v4l2_ioctl_ops solo_v4l2_ioctl_ops = {
 	.vidioc_querycap		= solo_querycap,
+	.vidioc_g_std			= solo_g_std,
 	.vidioc_s_std			= solo_s_std,
 	/* Input callbacks */
 	.vidioc_enum_input		= solo_enum_input,
@@ -811,10 +822,6 @@ static const struct v4l2_ioctl_ops solo_v4l2_ioctl_ops = {
 	.vidioc_dqbuf			= solo_dqbuf,
 	.vidioc_streamon		= solo_streamon,
 	.vidioc_streamoff		= solo_streamoff,
-	/* Controls */
-	.vidioc_queryctrl		= solo_disp_queryctrl,
-	.vidioc_g_ctrl			= solo_disp_g_ctrl,
-	.vidioc_s_ctrl			= solo_disp_s_ctrl,
 };
 
 static struct video_device solo_v4l2_template = {
@@ -823,9 +830,11 @@ static struct video_device solo_v4l2_template = {
 	.ioctl_ops		= &solo_v4l2_ioctl_ops,
 	.minor			= -1,
 	.release		= video_device_release,
+	.device_caps		= V4L2_CAP_VIDEO_CAPTURE |
+				  V4L2_CAP_READWRITE |
+				  V4L2_CAP_STREAMING,
 
 	.tvnorms		= V4L2_STD_NTSC_M | V4L2_STD_PAL_B,
-	.current_norm		= V4L2_STD_NTSC_M,
 };
 
 int solo_v4l2_init(struct solo_dev *solo_dev, unsigned nr)
@@ -836,14 +845,24 @@ int solo_v4l2_init(struct solo_dev *solo_dev, unsigned nr)
 	atomic_set(&solo_dev->disp_users, 0);
 	init_waitqueue_head(&solo_dev->disp_thread_wait);
 
+	v4l2_ctrl_handler_init(&solo_dev->disp_hdl, 3);
+	solo_ctrl_new_placeholder(&solo_dev->disp_hdl, V4L2_CID_MOTION_ENABLE);
+	solo_ctrl_new_placeholder(&solo_dev->disp_hdl,
+				  V4L2_CID_MOTION_THRESHOLD);
+	v4l2_ctrl_new_custom(&solo_dev->disp_hdl, &solo_motion_trace_ctrl,
+			     NULL);
+	if (solo_dev->disp_hdl.error)
+		return solo_dev->disp_hdl.error;
+
 	solo_dev->vfd = video_device_alloc();
 	if (!solo_dev->vfd)
 		return -ENOMEM;
 
 	*solo_dev->vfd = solo_v4l2_template;
-	solo_dev->vfd->parent = &solo_dev->pdev->dev;
+	solo_dev->vfd->v4l2_dev = &solo_dev->v4l2_dev;
+	solo_dev->vfd->ctrl_handler = &solo_dev->disp_hdl;
 
-	ret = video_register_device(solo_dev->vfd, VFL_TYPE_GRABBER, nr);
+	ret = video_register_device(solo_dev->vfd, VFL_TYPE_VIDEO, nr);
 	if (ret < 0) {
 		video_device_release(solo_dev->vfd);
 		solo_dev->vfd = NULL;
@@ -876,9 +895,10 @@ int solo_v4l2_init(struct solo_dev *solo_dev, unsigned nr)
 
 void solo_v4l2_exit(struct solo_dev *solo_dev)
 {
-	if (solo_dev->vfd == NULL)
-		return;
+	if (solo_dev->vfd) {
+		video_unregister_device(solo_dev->vfd);
+		solo_dev->vfd = NULL;
+	}
 
-	video_unregister_device(solo_dev->vfd);
-	solo_dev->vfd = NULL;
+	v4l2_ctrl_handler_free(&solo_dev->disp_hdl);
 }
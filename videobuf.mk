@@ -23,6 +23,6 @@ $(obj)/%.in: $(V4L2SRC)/%
 	$(Q)ln -sf $< $@
 endif
 
-$(obj)/videobuf-dma-contig.c $(obj)/videobuf-dma-sg.c: %:%.in
+$(obj)/videobuf-dma-contig.c: %:%.in
 	$(if $(KBUILD_VERBOSE:1=),@echo '  MERGE  ' $@)
 	$(Q)sed '/^MODULE_/d;/^EXPORT_SYMBOL_GPL/d' $< > $@